@@ -35,7 +35,9 @@
 #error No network interface defined!
 #endif
 
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <util/delay.h>
@@ -51,11 +53,68 @@
 #include <net/tcpdump.h>
 #endif
 
+#if CONFIG_DRIVERS_ENC424J600 && CONFIG_DRIVERS_ENC424J600_CHKSUM && \
+	!CONFIG_LIB_CONTIKI_IPV6
+#define NETWORK_CHKSUM 1
+#include <chksum.h>
+
+#if !UIP_ARCH_CHKSUM
+#error DRIVERS_ENC424J600_CHKSUM needs UIP_ARCH_CHKSUM in contiki-conf.h
+#endif
+
+// What the next TCP or UDP checksum uIP asks for is for
+#define CHKSUM_TX		0 // outgoing; the NIC fills it in
+#define CHKSUM_RX		1 // incoming, to be checked in software
+#define CHKSUM_RX_OK	2 // incoming, already checked by the NIC
+
+// Length of the frame used to test the DMA checksum at start-up; odd, to
+// check the padding of the last byte too
+#define CHKSUM_TEST_LEN	61
+#endif
+
+#if CONFIG_DRIVERS_ENC424J600 && CONFIG_APPS_NETWORK_FILTER
+#define NETWORK_FILTER 1
+#endif
+
+#if CONFIG_DRIVERS_ENC424J600 && ENC424J600_TX_SLOTS > 1 && UIP_TCP
+#define NETWORK_TXCACHE 1
+
+// TCP flags that open or close a connection: FIN, SYN and RST
+#define TXCACHE_TCP_CONN 0x07
+
+#if CONFIG_LIB_CONTIKI_IPV6
+#define TXCACHE_ETHTYPE UIP_ETHTYPE_IPV6
+#else
+#define TXCACHE_ETHTYPE UIP_ETHTYPE_IP
+#endif
+#endif
+
+#if NETWORK_FILTER && CONFIG_APPS_DHCP && !CONFIG_LIB_CONTIKI_IPV6
+#define NETWORK_RENEW 1
+#include <sys/stimer.h>
+#endif
+
+#if CONFIG_DRIVERS_ENC424J600 && defined(CONFIG_DRIVERS_ENC424J600_INT_VECT)
+#define NETWORK_INT 1
+#define INT_BIT _BV(CONFIG_DRIVERS_ENC424J600_INT_PIN)
+
+// How often to check the link and ARP timers when no packets arrive
+#define PERIODIC_INTERVAL CLOCK_SECOND
+#endif
+
+#if CONFIG_DRIVERS_ENC424J600
+// How often to read the PHY status when the link hasn't changed
+#define PHY_INTERVAL (CLOCK_SECOND * 10)
+#endif
+
 #define BUF ((struct uip_eth_hdr *)&uip_buf[0])
 #define IPBUF ((struct uip_tcpip_hdr *)&uip_buf[UIP_LLH_LEN])
+#define UDPBUF ((struct uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN])
 
 process_event_t net_event;
 network_status_t net_status;
+network_rx_stats_t net_rx_stats;
+uint32_t net_rx_hist[NETWORK_RX_BUDGET + 1];
 
 #if CONFIG_DRIVERS_ENC28J60
 static struct uip_eth_addr mac PROGMEM =
@@ -66,6 +125,42 @@ static struct uip_eth_addr mac PROGMEM =
 static struct timer arp_timer;
 #endif
 
+#if NETWORK_INT
+static struct etimer periodic_timer;
+#endif
+
+#if CONFIG_DRIVERS_ENC424J600
+static struct timer phy_timer;
+#endif
+
+#if NETWORK_CHKSUM
+static uint8_t chksum_state;
+// Whether the NIC's checksums agree with ours, see network_chksum_test()
+static uint8_t chksum_offload;
+#endif
+
+#if NETWORK_TXCACHE
+// TCP data segments left in the NIC's TX slots, for network_rexmit(). Slot
+// 0 takes all other packets, and the rest are used in turn, so segments
+// stay there for as long as possible.
+struct tx_segment {
+	struct uip_conn *conn;
+	uint32_t seq;
+	uint16_t datalen;
+	uint16_t len;
+};
+
+static struct tx_segment tx_segments[ENC424J600_TX_SLOTS - 1];
+static uint8_t tx_next;
+#endif
+
+#if NETWORK_RENEW
+// Broadcasts are let back in from half way through the DHCP lease, as the
+// replies to renewals may be broadcast
+static struct stimer renew_timer;
+static uint8_t renewing;
+#endif
+
 PROCESS(network_process, "Network");
 INIT_PROCESS(network_process);
 INIT_PROCESS(tcpip_process);
@@ -102,6 +197,28 @@ static void tcpdump(uint8_t *pkt, uint16_t len) {
 }
 #endif
 
+#if NETWORK_INT
+// INT is held low while there are packets waiting. Mask it until the
+// network process has read them all, so it doesn't keep firing.
+ISR(CONFIG_DRIVERS_ENC424J600_INT_VECT) {
+	if (!(CONFIG_DRIVERS_ENC424J600_INT_PINREG & INT_BIT)) {
+		CONFIG_DRIVERS_ENC424J600_INT_PCMSK &= ~INT_BIT;
+		process_poll(&network_process);
+	}
+}
+
+// Unmask INT once the receive buffer is empty
+static void network_int_arm(void) {
+	CONFIG_DRIVERS_ENC424J600_INT_PCMSK |= INT_BIT;
+
+	// A packet may have arrived since the buffer was last checked, in
+	// which case there won't be an edge to wake us up
+	if (!(CONFIG_DRIVERS_ENC424J600_INT_PINREG & INT_BIT)) {
+		process_poll(&network_process);
+	}
+}
+#endif
+
 void network_get_macaddr(struct uip_eth_addr *addr) {
 #if CONFIG_DRIVERS_ENC28J60
 	// Set our MAC address
@@ -113,6 +230,330 @@ void network_get_macaddr(struct uip_eth_addr *addr) {
 #endif
 }
 
+#if NETWORK_CHKSUM
+u16_t uip_chksum(u16_t *data, u16_t len) {
+	return uip_htons(chksum(0, (uint8_t *)data, len));
+}
+
+u16_t uip_ipchksum(void) {
+	uint16_t sum = chksum(0, &uip_buf[UIP_LLH_LEN], UIP_IPH_LEN);
+
+	return (sum == 0) ? 0xffff : uip_htons(sum);
+}
+
+static uint16_t upper_layer_len(void) {
+	return ((IPBUF->len[0] << 8) + IPBUF->len[1]) - UIP_IPH_LEN;
+}
+
+// Sum of the TCP/UDP pseudo-header, in host order
+static uint16_t pseudo_chksum(uint8_t proto, uint16_t len) {
+	return chksum(len + proto, (uint8_t *)&IPBUF->srcipaddr,
+		2 * sizeof(uip_ipaddr_t));
+}
+
+static u16_t upper_layer_chksum(uint8_t proto) {
+	uint8_t state = chksum_state;
+	uint16_t len, sum;
+
+	// Only the first call for an incoming packet is to check it; the rest
+	// are for replies
+	chksum_state = CHKSUM_TX;
+
+	if (state != CHKSUM_RX) {
+		// Either it's good, or the field is zero for network_send() to
+		// fill in
+		return 0xffff;
+	}
+
+	len = upper_layer_len();
+	sum = chksum(pseudo_chksum(proto, len),
+		&uip_buf[UIP_LLH_LEN + UIP_IPH_LEN], len);
+
+	return (sum == 0) ? 0xffff : uip_htons(sum);
+}
+
+u16_t uip_tcpchksum(void) {
+	return upper_layer_chksum(UIP_PROTO_TCP);
+}
+
+u16_t uip_udpchksum(void) {
+	return upper_layer_chksum(UIP_PROTO_UDP);
+}
+
+// Have the NIC check the TCP or UDP checksum of the packet in uip_buf,
+// which must still be in its RX buffer
+static uint8_t network_rx_chksum(uint16_t len) {
+	uint8_t proto = IPBUF->proto;
+	uint16_t l4len;
+
+	if (!chksum_offload ||
+		len < UIP_LLH_LEN + UIP_IPUDPH_LEN ||
+		BUF->type != UIP_HTONS(UIP_ETHTYPE_IP) ||
+		IPBUF->vhl != 0x45 ||
+		(IPBUF->ipoffset[0] & 0x3f) || IPBUF->ipoffset[1])
+	{
+		return 0;
+	}
+
+	// uIP doesn't check UDP packets without a checksum
+	if (proto != UIP_PROTO_TCP &&
+		(proto != UIP_PROTO_UDP || UDPBUF->udpchksum == 0))
+	{
+		return 0;
+	}
+
+	l4len = upper_layer_len();
+	if (UIP_LLH_LEN + UIP_IPH_LEN + l4len > len) {
+		return 0;
+	}
+
+	return enc424j600RxChecksum(UIP_LLH_LEN + UIP_IPH_LEN, l4len,
+		pseudo_chksum(proto, l4len)) == 0;
+}
+
+// Send uip_buf, with the NIC filling in the TCP or UDP checksum, or with
+// it filled in here if the NIC can't be trusted to
+static void network_tx_chksum(void) {
+	uint8_t proto = IPBUF->proto;
+	uint16_t offset = 0;
+	uint16_t l4len, sum;
+
+	if (BUF->type == UIP_HTONS(UIP_ETHTYPE_IP)) {
+		if (proto == UIP_PROTO_TCP) {
+			offset = offsetof(struct uip_tcpip_hdr, tcpchksum);
+		}
+		else if (proto == UIP_PROTO_UDP) {
+			offset = offsetof(struct uip_udpip_hdr, udpchksum);
+		}
+	}
+
+	if (offset) {
+		// The old value would be summed along with the rest
+		offset += UIP_LLH_LEN;
+		uip_buf[offset] = 0;
+		uip_buf[offset + 1] = 0;
+	}
+
+	if (offset && !chksum_offload) {
+		l4len = upper_layer_len();
+		sum = ~chksum(pseudo_chksum(proto, l4len),
+			&uip_buf[UIP_LLH_LEN + UIP_IPH_LEN], l4len);
+
+		// Zero means no checksum for UDP
+		if (sum == 0 && proto == UIP_PROTO_UDP) {
+			sum = 0xffff;
+		}
+
+		uip_buf[offset] = sum >> 8;
+		uip_buf[offset + 1] = sum & 0xff;
+		offset = 0;
+	}
+
+	enc424j600PacketWrite(uip_len, (uint8_t *)uip_buf);
+
+	if (offset) {
+		l4len = upper_layer_len();
+		sum = enc424j600TxChecksum(UIP_LLH_LEN + UIP_IPH_LEN, l4len,
+			pseudo_chksum(proto, l4len));
+
+		// Zero means no checksum for UDP
+		if (sum == 0 && proto == UIP_PROTO_UDP) {
+			sum = 0xffff;
+		}
+
+		sum = uip_htons(sum);
+		enc424j600PacketPatch(offset, (uint8_t *)&sum, sizeof(sum));
+	}
+
+	enc424j600PacketTransmit(uip_len);
+}
+
+// The EDMACS byte order and seed form come from the datasheet, so check the
+// DMA engine against chksum() once before letting it near real packets
+static void network_chksum_test(void) {
+	const uint16_t seed = 0x1234;
+	uint16_t sum;
+
+	for (uint8_t i = 0; i < CHKSUM_TEST_LEN; i++) {
+		uip_buf[i] = i * 37 + 1;
+	}
+
+	enc424j600PacketWrite(CHKSUM_TEST_LEN, (uint8_t *)uip_buf);
+	sum = enc424j600TxChecksum(0, CHKSUM_TEST_LEN, seed);
+	chksum_offload = (sum == (uint16_t)~chksum(seed,
+		(uint8_t *)uip_buf, CHKSUM_TEST_LEN));
+
+#if CONFIG_APPS_SYSLOG
+	if (!chksum_offload) {
+		syslog_P(
+			LOG_KERN | LOG_WARNING,
+			PSTR("DMA checksum mismatch, offload disabled"));
+	}
+#endif
+}
+#endif
+
+#if NETWORK_FILTER
+// Only let through what uIP has a use for, so that broadcast and multicast
+// noise doesn't take up the SPI bus
+static void network_filter(void) {
+	uint16_t erxfcon = ERXFCON_CRCEN | ERXFCON_RUNTEN | ERXFCON_UCEN;
+
+#if CONFIG_LIB_CONTIKI_IPV6
+	uint8_t group[6] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 };
+
+	// All-nodes, and the solicited-node group for our addresses, which are
+	// all based on the MAC address
+	enc424j600HashClear();
+	enc424j600HashAdd(group);
+	group[2] = 0xff;
+	memcpy(&group[3], &uip_lladdr.addr[3], 3);
+	enc424j600HashAdd(group);
+
+	erxfcon |= ERXFCON_HTEN;
+#else
+	uint8_t configured = net_status.configured;
+
+#if NETWORK_RENEW
+	configured = configured && !renewing;
+#endif
+
+	if (configured) {
+		// Broadcasts only for ARP requests for our address: the bytes
+		// checked are the ethertype, opcode and target IP address
+		static const uint16_t mask[4] = { 0x3000, 0x0030, 0x03c0, 0x0000 };
+		uint8_t pattern[8] = { 0x08, 0x06, 0x00, 0x01 };
+
+		memcpy(&pattern[4], &uip_hostaddr, 4);
+		enc424j600SetPattern(0, mask,
+			~uip_ntohs(uip_chksum((u16_t *)pattern, sizeof(pattern))));
+
+		erxfcon |= ERXFCON_PM_BROADCAST;
+	}
+	else {
+		// DHCP replies may be broadcast
+		erxfcon |= ERXFCON_BCEN;
+	}
+#endif
+
+	enc424j600SetRxFilter(erxfcon);
+}
+#endif
+
+#if NETWORK_TXCACHE
+static uint32_t seq32(const uint8_t *seq) {
+	return ((uint32_t)seq[0] << 24) | ((uint32_t)seq[1] << 16) |
+		((uint16_t)seq[2] << 8) | seq[3];
+}
+
+// Is the TCP segment in uip_buf being sent for conn?
+static uint8_t tx_conn_matches(struct uip_conn *conn) {
+	return conn != NULL &&
+		conn->lport == IPBUF->srcport &&
+		conn->rport == IPBUF->destport &&
+		uip_ipaddr_cmp(&conn->ripaddr, &IPBUF->destipaddr);
+}
+
+// Pick the TX slot for uip_buf, remembering TCP data segments
+static uint8_t network_tx_slot(void) {
+	struct tx_segment *seg;
+
+	if (BUF->type != UIP_HTONS(TXCACHE_ETHTYPE) ||
+		IPBUF->proto != UIP_PROTO_TCP)
+	{
+		return 0;
+	}
+
+	// Whatever was kept for a connection that is being opened, closed or
+	// aborted is of no more use
+	if (IPBUF->flags & TXCACHE_TCP_CONN) {
+		for (uint8_t i = 0; i < ENC424J600_TX_SLOTS - 1; i++) {
+			if (tx_conn_matches(tx_segments[i].conn)) {
+				tx_segments[i].conn = NULL;
+			}
+		}
+		return 0;
+	}
+
+	// uIP leaves uip_conn pointing at the connection it's sending for
+	if (IPBUF->tcpoffset != (UIP_TCPH_LEN / 4) << 4 ||
+		uip_len <= UIP_LLH_LEN + UIP_TCPIP_HLEN ||
+		!tx_conn_matches(uip_conn))
+	{
+		return 0;
+	}
+
+	seg = &tx_segments[tx_next];
+	seg->conn = uip_conn;
+	seg->seq = seq32(IPBUF->seqno);
+	seg->datalen = uip_len - UIP_LLH_LEN - UIP_TCPIP_HLEN;
+	seg->len = uip_len;
+
+	if (++tx_next == ENC424J600_TX_SLOTS - 1) {
+		tx_next = 0;
+	}
+
+	return (seg - tx_segments) + 1;
+}
+#endif
+
+uint8_t network_rexmit(void) {
+#if NETWORK_TXCACHE
+	uint8_t slots[ENC424J600_TX_SLOTS - 1];
+	uint8_t count = 0;
+	uint32_t seq = seq32(uip_conn->snd_nxt);
+	uint16_t done = 0;
+
+	if (uip_conn->len == 0) {
+		return 0;
+	}
+
+	// Find the segment, or both halves of it if uip-split got to it
+	while (done < uip_conn->len) {
+		uint8_t i;
+
+		for (i = 0; i < ENC424J600_TX_SLOTS - 1; i++) {
+			struct tx_segment *seg = &tx_segments[i];
+
+			if (seg->conn == uip_conn && seg->seq == seq + done) {
+				break;
+			}
+		}
+		if (i == ENC424J600_TX_SLOTS - 1 || count == sizeof(slots)) {
+			return 0;
+		}
+
+		slots[count++] = i;
+		done += tx_segments[i].datalen;
+	}
+	if (done != uip_conn->len) {
+		return 0;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		enc424j600TxSelect(slots[i] + 1);
+		enc424j600PacketTransmit(tx_segments[slots[i]].len);
+	}
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+// How many frames to read on this poll
+static uint8_t network_pending(void) {
+#if CONFIG_DRIVERS_ENC28J60
+	// No cheap way to tell; read until there are none left
+	return NETWORK_RX_BUDGET;
+#endif
+#if CONFIG_DRIVERS_ENC424J600
+	uint8_t count = enc424j600PacketCount();
+
+	return count > NETWORK_RX_BUDGET ? NETWORK_RX_BUDGET : count;
+#endif
+}
+
 static uint16_t network_read(void) {
 	uint16_t len;
 
@@ -120,7 +561,14 @@ static uint16_t network_read(void) {
 	len = enc28j60PacketReceive(UIP_BUFSIZE, (uint8_t *)uip_buf);
 #endif
 #if CONFIG_DRIVERS_ENC424J600
-	len = enc424j600PacketReceive(UIP_BUFSIZE, (uint8_t *)uip_buf);
+	// network_pending() has already checked there's one there
+#if NETWORK_CHKSUM
+	len = enc424j600PacketCopy(UIP_BUFSIZE, (uint8_t *)uip_buf);
+	chksum_state = network_rx_chksum(len) ? CHKSUM_RX_OK : CHKSUM_RX;
+	enc424j600PacketRelease();
+#else
+	len = enc424j600PacketRead(UIP_BUFSIZE, (uint8_t *)uip_buf);
+#endif
 #endif
 
 #if TCPDUMP
@@ -156,7 +604,14 @@ static uint8_t network_send(void) {
 	}
 #endif
 #if CONFIG_DRIVERS_ENC424J600
+#if NETWORK_TXCACHE
+	enc424j600TxSelect(network_tx_slot());
+#endif
+#if NETWORK_CHKSUM
+	network_tx_chksum();
+#else
 	enc424j600PacketSend(uip_len, (uint8_t *)uip_buf);
+#endif
 #endif
 
 	uip_len = 0;
@@ -232,6 +687,18 @@ static void network_init(void) {
 
 	// Get the MAC address
 	enc424j600GetMACAddr(macaddr.addr);
+
+#if NETWORK_CHKSUM
+	network_chksum_test();
+#endif
+
+	timer_set(&phy_timer, PHY_INTERVAL);
+#endif
+
+#if NETWORK_INT
+	// Enable the pin change interrupt for INT; it gets unmasked once the
+	// network process has had a first look for packets
+	PCICR |= _BV(CONFIG_DRIVERS_ENC424J600_INT_PCIE);
 #endif
 
 #if !CONFIG_LIB_CONTIKI_IPV6
@@ -240,9 +707,22 @@ static void network_init(void) {
 #endif
 
 	uip_setethaddr(macaddr);
+
+#if NETWORK_FILTER
+	network_filter();
+#endif
 }
 
 static void update_status(void) {
+#if CONFIG_DRIVERS_ENC424J600
+	// Reading the PHY takes a dozen SPI transactions, so only do it when
+	// the chip says the link changed, with the timer as a backstop
+	if (!enc424j600LinkChanged() && !timer_expired(&phy_timer)) {
+		return;
+	}
+	timer_restart(&phy_timer);
+#endif
+
 	network_status_t new = net_status;
 
 #if CONFIG_DRIVERS_ENC28J60
@@ -271,6 +751,11 @@ static void update_status(void) {
 	if (memcmp(&new, &net_status, sizeof(net_status)) != 0) {
 		net_status = new;
 
+#if NETWORK_FILTER
+		// We may have lost our address
+		network_filter();
+#endif
+
 		// Send link change event
 		process_post(PROCESS_BROADCAST, net_event, &net_status);
 
@@ -291,41 +776,93 @@ static void update_status(void) {
 	}
 }
 
+static void network_input(void) {
+#if CONFIG_LIB_CONTIKI_IPV6
+	// Handle IP packets
+	if (BUF->type == UIP_HTONS(UIP_ETHTYPE_IPV6)) {
+		tcpip_input();
+	}
+#else
+	// Handle IP packets
+	if (BUF->type == UIP_HTONS(UIP_ETHTYPE_IP)) {
+		tcpip_input();
+#if NETWORK_CHKSUM
+		chksum_state = CHKSUM_TX;
+#endif
+	}
+	// Handle ARP packets
+	else if (BUF->type == UIP_HTONS(UIP_ETHTYPE_ARP)) {
+		uip_arp_arpin();
+		if (uip_len > 0) {
+			network_send();
+		}
+	}
+#endif
+	else {
+		uip_len = 0;
+		net_rx_stats.dropped++;
+	}
+}
+
 static void pollhandler(void) {
+	uint8_t pending;
+	uint8_t drained = 0;
+
+#if !NETWORK_INT
 	process_poll(&network_process);
+#endif
 
 	update_status();
-	uip_len = network_read();
 
-	if (uip_len > 0) {
-#if CONFIG_LIB_CONTIKI_IPV6
-		// Handle IP packets
-		if (BUF->type == UIP_HTONS(UIP_ETHTYPE_IPV6)) {
-			tcpip_input();
-		}
-#else
-		// Handle IP packets
-		if (BUF->type == UIP_HTONS(UIP_ETHTYPE_IP)) {
-			tcpip_input();
-		}
-		// Handle ARP packets
-		else if (BUF->type == UIP_HTONS(UIP_ETHTYPE_ARP)) {
-			uip_arp_arpin();
-			if (uip_len > 0) {
-				network_send();
-			}
+	// Read what's waiting, up to the budget, then let other processes
+	// have a go before coming back for the rest
+	pending = network_pending();
+	while (drained < pending) {
+		uip_len = network_read();
+#if CONFIG_DRIVERS_ENC28J60
+		if (uip_len == 0) {
+			break;
 		}
 #endif
+		drained++;
+		net_rx_stats.frames++;
+
+		if (uip_len > 0) {
+			network_input();
+		}
 		else {
-			uip_len = 0;
+			net_rx_stats.dropped++;
 		}
 	}
+	net_rx_hist[drained]++;
+
+#if CONFIG_DRIVERS_ENC424J600
+	net_rx_stats.overruns = enc424j600RxAborts();
+#endif
+
+#if NETWORK_RENEW
+	if (net_status.configured && !renewing && stimer_expired(&renew_timer)) {
+		renewing = 1;
+		network_filter();
+	}
+#endif
+
 #if !CONFIG_LIB_CONTIKI_IPV6
-	else if (timer_expired(&arp_timer)) {
+	if (timer_expired(&arp_timer)) {
 		timer_reset(&arp_timer);
 		uip_arp_timer();
 	}
 #endif
+
+#if NETWORK_INT
+	// Come back for the rest, or wait for INT if there are none left
+	if (drained == NETWORK_RX_BUDGET) {
+		process_poll(&network_process);
+	}
+	else {
+		network_int_arm();
+	}
+#endif
 }
 
 PROCESS_THREAD(network_process, ev, data) {
@@ -336,11 +873,40 @@ PROCESS_THREAD(network_process, ev, data) {
 	tcpip_set_outputfunc(network_send_tcpip);
 	process_poll(&network_process);
 
+#if NETWORK_INT
+	etimer_set(&periodic_timer, PERIODIC_INTERVAL);
+#endif
+
 	while (1) {
 		PROCESS_WAIT_EVENT();
 
+#if NETWORK_INT
+		// Check the link and ARP timers even if nothing arrives
+		if (ev == PROCESS_EVENT_TIMER && data == &periodic_timer) {
+			etimer_reset(&periodic_timer);
+			process_poll(&network_process);
+			continue;
+		}
+#endif
+
 #if CONFIG_APPS_DHCP
 		if (ev == dhcp_event) {
+#if NETWORK_RENEW
+			// Every lease, renewed or not, comes with one of these
+			if (dhcp_status.configured && dhcp_status.state) {
+				const struct dhcpc_state *s = dhcp_status.state;
+				uint32_t lease = uip_ntohs(s->lease_time[0]) * 65536ul +
+					uip_ntohs(s->lease_time[1]);
+
+				// dhcpc renews at half the lease; open up well before
+				// then, as this is only checked when the pollhandler runs.
+				// Opening early on very long leases does no harm.
+				lease = lease / 2 - lease / 8;
+				stimer_set(&renew_timer, lease > 0xffff ? 0xffff : lease);
+				renewing = 0;
+			}
+#endif
+
 			if (dhcp_status.configured != net_status.configured) {
 				net_status.configured = dhcp_status.configured;
 				process_post(PROCESS_BROADCAST, net_event, &net_status);
@@ -352,6 +918,10 @@ PROCESS_THREAD(network_process, ev, data) {
 					net_status.configured ? PSTR("") : PSTR("de-"));
 #endif
 			}
+
+#if NETWORK_FILTER
+			network_filter();
+#endif
 		}
 		else
 #endif
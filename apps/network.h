@@ -28,9 +28,30 @@ typedef struct {
 	int configured : 1;
 } network_status_t;
 
+#ifdef CONFIG_APPS_NETWORK_RX_BUDGET
+#define NETWORK_RX_BUDGET CONFIG_APPS_NETWORK_RX_BUDGET
+#else
+#define NETWORK_RX_BUDGET 4
+#endif
+
+typedef struct {
+	uint32_t frames;	// read from the NIC
+	uint32_t dropped;	// read, but not IP or ARP, or too big
+	uint16_t overruns;	// lost by the NIC for want of buffer space
+} network_rx_stats_t;
+
 extern process_event_t net_event;
 extern network_status_t net_status;
+extern network_rx_stats_t net_rx_stats;
+
+// Number of polls that read 0, 1, ... NETWORK_RX_BUDGET frames
+extern uint32_t net_rx_hist[NETWORK_RX_BUDGET + 1];
 
 void network_get_macaddr(struct uip_eth_addr *addr);
 
+// For applications to call when uip_rexmit() is true. If the NIC still has
+// the unacknowledged data for uip_conn, it sends it again and this returns
+// nonzero; the application must then not send anything itself.
+uint8_t network_rexmit(void);
+
 #endif
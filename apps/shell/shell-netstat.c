@@ -41,6 +41,10 @@
 #include "shell.h"
 #include "contiki-net.h"
 
+#if CONFIG_APPS_NETWORK
+#include "apps/network.h"
+#endif
+
 static const char closed[] PROGMEM =   /*  "CLOSED",*/
 {0x43, 0x4c, 0x4f, 0x53, 0x45, 0x44, 0};
 static const char syn_rcvd[] PROGMEM = /*  "SYN-RCVD",*/
@@ -138,6 +142,18 @@ PROCESS_THREAD(shell_netstat_process, ev, data) {
 			UIP_HTONS(uip_listenports[i]));
 	}
 
+#if CONFIG_APPS_NETWORK
+	shell_output_P(&netstat_command,
+		PSTR("RX %lu frames, %lu dropped, %u overruns\n"),
+		net_rx_stats.frames, net_rx_stats.dropped, net_rx_stats.overruns);
+
+	shell_output_P(&netstat_command, PSTR("Frames read per poll:\n"));
+	for (i = 0; i <= NETWORK_RX_BUDGET; i++) {
+		shell_output_P(&netstat_command, PSTR("%d: %lu\n"),
+			i, net_rx_hist[i]);
+	}
+#endif
+
 	PROCESS_END();
 }
 
@@ -43,6 +43,8 @@ struct tftpupdate_params {
 	struct resolv_helper_status res;
 	char filename[32];
 	struct tftp_state s;
+	struct flashmgt_write_stats stats;
+	uint32_t resume; // offset the flash write carries on from
 };
 
 struct tftpupdate_params *tftpupdate = NULL;
@@ -69,6 +71,30 @@ static int tftpupdate_iofunc(struct tftp_state *s, uint32_t offset,
 {
 	int err;
 
+	// Make sure it's the same image that was partly written last time
+	if (offset < tftpupdate->resume) {
+		err = flashmgt_sec_write_check(buf, offset, size);
+		if (err) {
+			shell_output_P(&tftpupdate_command,
+				PSTR("\rImage has changed since the last attempt, "
+					"please try again\n"));
+			return err;
+		}
+	}
+
+	// Skip over whatever made it into the flash last time
+	if (offset + size <= tftpupdate->resume) {
+		shell_output_P(&tftpupdate_command,
+			PSTR("\r%c"),
+			pgm_read_byte(&progress[s->block % sizeof(progress)]));
+		return 0;
+	}
+	else if (offset < tftpupdate->resume) {
+		buf = (uint8_t *)buf + (tftpupdate->resume - offset);
+		size -= tftpupdate->resume - offset;
+		offset = tftpupdate->resume;
+	}
+
 	// Write the flash block
 	err = flashmgt_sec_write_block(buf, offset, size);
 	if (err) {
@@ -88,6 +114,7 @@ static int tftpupdate_iofunc(struct tftp_state *s, uint32_t offset,
 PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 	char *s;
 	int err;
+	uint32_t id;
 
 	PROCESS_BEGIN();
 
@@ -175,8 +202,15 @@ PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 	shell_output_P(&tftpupdate_command,
 		PSTR("Preparing to write to flash...\n"));
 
-	// Start the flash write
-	err = flashmgt_sec_write_start();
+	// A failed download of the same file from the same server is picked
+	// up where it left off
+	id = polyfs_crc32(0, &tftpupdate->res.ipaddr,
+		sizeof(tftpupdate->res.ipaddr));
+	id = polyfs_crc32(id, tftpupdate->filename,
+		strlen(tftpupdate->filename));
+
+	// Start the flash write; TFTP doesn't tell us the size up front
+	err = flashmgt_sec_write_resume(id, 0, &tftpupdate->resume);
 	if (err) {
 		shell_output_P(&tftpupdate_command,
 			PSTR("Could not set up flash write (%d).\n"), err);
@@ -184,6 +218,22 @@ PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 		PROCESS_EXIT();
 	}
 
+	if (tftpupdate->resume) {
+		shell_output_P(&tftpupdate_command,
+			PSTR("Resuming after %lu bytes already in flash.\n"),
+			tftpupdate->resume);
+	}
+
+	// Wait for the partition to be erased
+	PROCESS_WAIT_EVENT_UNTIL(ev == flashmgt_event);
+	err = (intptr_t)data;
+	if (err) {
+		shell_output_P(&tftpupdate_command,
+			PSTR("Could not erase flash (%d).\n"), err);
+		tftpupdate_cleanup();
+		PROCESS_EXIT();
+	}
+
 	// More user info
 	shell_output_P(&tftpupdate_command,
 		PSTR("Requesting '%s' from %u.%u.%u.%u...\n"),
@@ -244,6 +294,7 @@ PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 		PSTR("Completing update process...\n"));
 
 	// Finish the flash write process
+	flashmgt_sec_write_stats(&tftpupdate->stats);
 	err = flashmgt_sec_write_finish();
 	if (err) {
 		shell_output_P(&tftpupdate_command,
@@ -251,6 +302,9 @@ PROCESS_THREAD(shell_tftpupdate_process, ev, data) {
 			err);
 	}
 	else {
+		shell_output_P(&tftpupdate_command,
+			PSTR("Erased %u blocks, skipped %u already blank.\n"),
+			tftpupdate->stats.erased, tftpupdate->stats.skipped);
 		shell_output_P(&tftpupdate_command,
 			PSTR("New firmware image is in flash. "
 				"Please reboot to apply the upgrade.\n"),
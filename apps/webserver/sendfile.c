@@ -28,6 +28,7 @@
 
 #include "httpd.h"
 #include "httpd-cgi.h"
+#include "apps/network.h"
 
 #define REASON_NONE 0
 #define REASON_EOF 1
@@ -38,6 +39,13 @@ static unsigned short generator(void *state) {
 	struct sendfile_state *s = state;
 	struct sendfile_file_state *fs = list_head(s->stack);
 
+	// Have the NIC send the data again if it still can, rather than reading
+	// it all back in. Nothing is sent from here, but fs->ret and s->reason
+	// are left as they were for the first try.
+	if (uip_rexmit() && network_rexmit()) {
+		return 0;
+	}
+
 	// Seek to the offset to send from (this could be different to the fd
 	// internal offset due to retransmits)
 	cfs_offset_t ret = cfs_seek(fs->fd, fs->fpos, CFS_SEEK_SET);
@@ -267,12 +267,18 @@ int main(void) {
 		uart_puts("Applying code update. Please wait...\r\n");
 
 		// Run the flashmgmt bootloader code
-		int ret = flashmgt_bootload();
+		struct flashmgt_bootload_stats stats;
+		char num[6];
+		int ret = flashmgt_bootload(&stats);
 		if (ret) {
 			uart_puts("Code update failed!\r\n");
 		}
 		else {
-			uart_puts("Code has been updated.\r\n");
+			uart_puts("Code has been updated (");
+			uart_puts(utoa(stats.written, num, 10));
+			uart_puts(" pages written, ");
+			uart_puts(utoa(stats.skipped, num, 10));
+			uart_puts(" unchanged).\r\n");
 		}
 
 		// Reboot
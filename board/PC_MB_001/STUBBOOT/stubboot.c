@@ -33,6 +33,8 @@
 
 static int8_t api_write_page(uint16_t page, const void *addr);
 static int8_t api_update_loader(uint8_t pages, uint16_t crc, void *addr);
+static int8_t api_write_page_start(uint16_t page, const void *addr);
+static int8_t api_write_page_finish(uint16_t page, const void *addr);
 
 static struct stubboot_table table
 	__attribute__((used))
@@ -44,8 +46,23 @@ static struct stubboot_table table
 
 	.write_page = api_write_page,
 	.update_loader = api_update_loader,
+	.write_page_start = api_write_page_start,
+	.write_page_finish = api_write_page_finish,
 };
 
+// Disable interrupts, disable watchdog
+static inline void lockdown(void) {
+	__asm__ __volatile__ (
+		"cli" "\n\t"
+		"sts %0, %1" "\n\t"
+		"sts %0, __zero_reg__" "\n\t"
+		: /* no outputs */
+		: "M" (_SFR_MEM_ADDR(_WD_CONTROL_REG)),
+		"r" ((uint8_t)(_BV(_WD_CHANGE_BIT) | _BV(WDE)))
+		: "r0"
+		);
+}
+
 static int8_t write_page(uint16_t page, const void *buf1) {
 	uint8_t attempts = 0;
 	uint_farptr_t addr = (uint_farptr_t)page * SPM_PAGESIZE;
@@ -99,15 +116,7 @@ static int8_t api_write_page(uint16_t page, const void *buf) {
 	}
 
 	// Disable interrupts, disable watchdog
-	__asm__ __volatile__ (
-		"cli" "\n\t"
-		"sts %0, %1" "\n\t"
-		"sts %0, __zero_reg__" "\n\t"
-		: /* no outputs */
-		: "M" (_SFR_MEM_ADDR(_WD_CONTROL_REG)),
-		"r" ((uint8_t)(_BV(_WD_CHANGE_BIT) | _BV(WDE)))
-		: "r0"
-		);
+	lockdown();
 
 	// Don't allow the write_page API function to touch the bootloader
 	if (page >= (CONFIG_BOOTLDR_START_ADDR / SPM_PAGESIZE)) {
@@ -117,6 +126,79 @@ static int8_t api_write_page(uint16_t page, const void *buf) {
 	return write_page(page, buf);
 }
 
+static int8_t api_write_page_start(uint16_t page, const void *buf1) {
+	uint_farptr_t addr = (uint_farptr_t)page * SPM_PAGESIZE;
+	const uint8_t *buf = buf1;
+
+	// Check that we're being run from the bootloader section (interrupts moved)
+	if (!(MCUCR & _BV(IVSEL))) {
+		return -1;
+	}
+
+	// Disable interrupts, disable watchdog
+	lockdown();
+
+	// Don't allow the write_page API function to touch the bootloader
+	if (page >= (CONFIG_BOOTLDR_START_ADDR / SPM_PAGESIZE)) {
+		return -1;
+	}
+
+	// Make sure no SPM or EEPROM operations are taking place
+	boot_spm_busy_wait();
+	eeprom_busy_wait();
+
+	// Erase the page we're about to write to
+	boot_page_erase(addr);
+	boot_spm_busy_wait();
+
+	// Fill the page buffer
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+		// Set up little-endian word.
+		uint16_t w = buf[i] | (buf[i + 1] << 8);
+
+		boot_page_fill(addr + i, w);
+	}
+
+	// Store buffer in flash page, but don't wait for it
+	boot_page_write(addr);
+
+	return 0;
+}
+
+static int8_t api_write_page_finish(uint16_t page, const void *buf1) {
+	uint_farptr_t addr = (uint_farptr_t)page * SPM_PAGESIZE;
+	const uint8_t *buf = buf1;
+	int8_t ret;
+
+	// Check that we're being run from the bootloader section (interrupts moved)
+	if (!(MCUCR & _BV(IVSEL))) {
+		return -1;
+	}
+
+	// Disable interrupts, disable watchdog
+	lockdown();
+
+	// Don't allow the write_page API function to touch the bootloader
+	if (page >= (CONFIG_BOOTLDR_START_ADDR / SPM_PAGESIZE)) {
+		return -1;
+	}
+
+	// Wait for the write, then reenable RWW-section so we can read it back
+	boot_spm_busy_wait();
+	boot_rww_enable();
+
+	// Verify the write
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+		if (pgm_read_byte_far(addr + i) != buf[i]) {
+			// Do it all again the slow way
+			ret = write_page(page, buf);
+			return (ret < 0) ? ret : ret + 1;
+		}
+	}
+
+	return 0;
+}
+
 static int8_t api_update_loader(uint8_t pages, uint16_t crc, void *addr) {
 	uint16_t i;
 	uint8_t ret = 0;
@@ -129,15 +211,7 @@ static int8_t api_update_loader(uint8_t pages, uint16_t crc, void *addr) {
 	}
 
 	// Disable interrupts, disable watchdog
-	__asm__ __volatile__ (
-		"cli" "\n\t"
-		"sts %0, %1" "\n\t"
-		"sts %0, __zero_reg__" "\n\t"
-		: /* no outputs */
-		: "M" (_SFR_MEM_ADDR(_WD_CONTROL_REG)),
-		"r" ((uint8_t)(_BV(_WD_CHANGE_BIT) | _BV(WDE)))
-		: "r0"
-		);
+	lockdown();
 
 	// Check the bootloader size isn't too big
 	if (pages > (LOADER_SIZE / SPM_PAGESIZE)) {
@@ -0,0 +1,367 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Cycle-count benchmark, meant to be run under simavr with "make bench".
+ *
+ * Timer1 runs at the CPU clock and its overflows are counted in software,
+ * giving a 32-bit cycle counter. Each workload is run a fixed number of
+ * times and one line per workload is printed on UART0:
+ *
+ *   bench<TAB>name<TAB>iterations<TAB>total cycles<TAB>cycles/iteration
+ *
+ * The simulator is cycle-accurate, so the numbers are repeatable and can be
+ * compared directly between builds.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+
+#include <chksum.h>
+#include <minilzo/minilzo.h>
+#include <pid.h>
+#include <polyfs.h>
+#include <settings.h>
+#include <time.h>
+
+#include "drivers/spi.h"
+#include "drivers/uart.h"
+#include "apps/webserver/urlconv.h"
+
+// Size the CRC workload pretends the filesystem is
+#define CRC_BYTES	65536UL
+#define CRC_TEMP_SIZE	256
+
+#define BENCH_SETTINGS_KEY	0x7f00
+
+// Size of the SPI transfers, one compressed polyfs block
+#define SPI_BYTES	1024
+
+struct bench {
+	PGM_P name;
+	void (*fn)(void);
+	uint16_t iterations;
+};
+
+// Filesystem image linked in by the Makefile
+extern const uint8_t _binary_bench_pfs_start[] PROGMEM;
+extern const uint8_t _binary_bench_pfs_end[] PROGMEM;
+
+static volatile uint16_t timer_overflows;
+
+static polyfs_fs_t fs;
+static polyfs_fs_t crc_fs;
+
+static uint8_t lzo_in[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+static uint8_t lzo_out[POLYFS_BLOCK_SIZE];
+static lzo_uint lzo_in_len;
+
+static uint8_t crc_temp[CRC_TEMP_SIZE];
+
+static pid_data_t pid;
+static int16_t pid_value;
+
+static struct tm tm;
+static time_t tm_time;
+static char tm_buf[32];
+
+static char url_buf[64];
+
+static uint8_t spi_buf[SPI_BYTES];
+
+ISR(TIMER1_OVF_vect) {
+	timer_overflows++;
+}
+
+static int bench_putc(char c, FILE *stream) {
+	if (c == '\n') {
+		uart_putc('\r');
+	}
+
+	uart_putc(c);
+
+	return 0;
+}
+
+static FILE uart_stream =
+    FDEV_SETUP_STREAM(bench_putc, NULL, _FDEV_SETUP_WRITE);
+
+static uint32_t cycles(void) {
+	uint8_t sreg = SREG;
+	uint16_t lo, hi;
+
+	cli();
+	lo = TCNT1;
+	hi = timer_overflows;
+
+	// An overflow happened but the ISR hasn't run yet
+	if ((TIFR1 & _BV(TOV1)) && lo < 0x8000) {
+		hi++;
+	}
+
+	SREG = sreg;
+
+	return ((uint32_t)hi << 16) | lo;
+}
+
+static uint32_t image_size(void) {
+	return (uint16_t)_binary_bench_pfs_end - (uint16_t)_binary_bench_pfs_start;
+}
+
+static int read_image(polyfs_fs_t *fs, void *ptr,
+	uint32_t offset, uint32_t bytes)
+{
+	uint32_t size = image_size();
+
+	if (offset >= size) {
+		return 0;
+	}
+	if (offset + bytes > size) {
+		bytes = size - offset;
+	}
+
+	memcpy_P(ptr, _binary_bench_pfs_start + offset, bytes);
+	return bytes;
+}
+
+// Reads the image as though it were CRC_BYTES long, padded with zeros
+static int read_crc_image(polyfs_fs_t *fs, void *ptr,
+	uint32_t offset, uint32_t bytes)
+{
+	uint32_t size = image_size();
+	int ret;
+
+	if (offset >= CRC_BYTES) {
+		return 0;
+	}
+	if (offset + bytes > CRC_BYTES) {
+		bytes = CRC_BYTES - offset;
+	}
+
+	if (offset >= size) {
+		memset(ptr, 0, bytes);
+		return bytes;
+	}
+
+	ret = read_image(fs, ptr, offset, bytes);
+	memset((uint8_t *)ptr + ret, 0, bytes - ret);
+
+	if (offset == 0) {
+		struct polyfs_super *super = ptr;
+		super->size = POLYFS_32(CRC_BYTES);
+	}
+
+	return bytes;
+}
+
+static void setup_lzo(void) {
+	struct polyfs_inode inode;
+	uint32_t blocks, start, end;
+
+	if (polyfs_lookup(&fs, "/www/index.html", &inode)) {
+		return;
+	}
+
+	// Pull the first compressed block out of the image
+	blocks = (POLYFS_24(inode.size) + POLYFS_BLOCK_SIZE - 1) /
+		POLYFS_BLOCK_SIZE;
+	start = (POLYFS_GET_OFFSET(&inode) << 2) + blocks * 4;
+	read_image(&fs, &end, POLYFS_GET_OFFSET(&inode) << 2, sizeof(end));
+	end = POLYFS_32(end);
+
+	lzo_in_len = end - start;
+	if (lzo_in_len > sizeof(lzo_in)) {
+		lzo_in_len = 0;
+		return;
+	}
+
+	read_image(&fs, lzo_in, start, lzo_in_len);
+}
+
+static void bench_nothing(void) {
+}
+
+static void bench_crc32(void) {
+	// The CRC won't match because of the padding; we only want the time
+	polyfs_check_crc(&crc_fs, crc_temp, sizeof(crc_temp));
+}
+
+static void bench_lzo(void) {
+	lzo_uint out_len = sizeof(lzo_out);
+
+	lzo1x_decompress_safe(lzo_in, lzo_in_len, lzo_out, &out_len, NULL);
+}
+
+static void bench_lookup(void) {
+	struct polyfs_inode inode;
+
+	polyfs_lookup(&fs, "/www/media/styles.css", &inode);
+}
+
+static void bench_settings(void) {
+	uint32_t value;
+	size_t size = sizeof(value);
+
+	settings_get(BENCH_SETTINGS_KEY, 0, &value, &size);
+}
+
+static void bench_gmtime(void) {
+	gmtime(tm_time, &tm);
+	tm_time += 86399;
+}
+
+static void bench_strftime(void) {
+	strftime_P(tm_buf, sizeof(tm_buf), PSTR("%a, %d %b %Y %H:%M:%S GMT"), &tm);
+}
+
+static void bench_pid(void) {
+	pid_value += pid_run(512, pid_value, &pid) / 16;
+}
+
+static void bench_urlconv(void) {
+	urlconv_tofilename(url_buf, "/www/./media/../media//styles.css?x=1",
+		sizeof(url_buf));
+}
+
+static void bench_spi_rw(void) {
+	uint8_t *buf = spi_buf;
+
+	for (uint16_t i = 0; i < SPI_BYTES; i++) {
+		*buf++ = spi_rw(0x00);
+	}
+}
+
+static void bench_spi_read(void) {
+	spi_read_block(spi_buf, SPI_BYTES);
+}
+
+static void bench_spi_write(void) {
+	spi_write_block(spi_buf, SPI_BYTES);
+}
+
+// What the ENC424J600 DMA saves per kilobyte of TCP or UDP, each way
+static void bench_chksum(void) {
+	chksum(0, spi_buf, SPI_BYTES);
+}
+
+static const char name_nothing[] PROGMEM = "nothing";
+static const char name_crc32[] PROGMEM = "crc32_64k";
+static const char name_lzo[] PROGMEM = "lzo1x_decompress";
+static const char name_lookup[] PROGMEM = "polyfs_lookup";
+static const char name_settings[] PROGMEM = "settings_get";
+static const char name_gmtime[] PROGMEM = "gmtime";
+static const char name_strftime[] PROGMEM = "strftime_P";
+static const char name_pid[] PROGMEM = "pid_run";
+static const char name_urlconv[] PROGMEM = "urlconv";
+static const char name_spi_rw[] PROGMEM = "spi_rw_1k";
+static const char name_spi_read[] PROGMEM = "spi_read_block_1k";
+static const char name_spi_write[] PROGMEM = "spi_write_block_1k";
+static const char name_chksum[] PROGMEM = "chksum_1k";
+
+static const struct bench benches[] PROGMEM = {
+	{ name_nothing, bench_nothing, 100 },
+	{ name_crc32, bench_crc32, 2 },
+	{ name_lzo, bench_lzo, 20 },
+	{ name_lookup, bench_lookup, 50 },
+	{ name_settings, bench_settings, 50 },
+	{ name_gmtime, bench_gmtime, 100 },
+	{ name_strftime, bench_strftime, 100 },
+	{ name_pid, bench_pid, 100 },
+	{ name_urlconv, bench_urlconv, 100 },
+	{ name_spi_rw, bench_spi_rw, 10 },
+	{ name_spi_read, bench_spi_read, 10 },
+	{ name_spi_write, bench_spi_write, 10 },
+	{ name_chksum, bench_chksum, 10 },
+};
+
+static uint32_t run_bench(void (*fn)(void), uint16_t iterations) {
+	uint32_t start, end;
+
+	start = cycles();
+	for (uint16_t i = 0; i < iterations; i++) {
+		fn();
+	}
+	end = cycles();
+
+	return end - start;
+}
+
+int main(void) {
+	// Timer1 counts CPU cycles
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);
+	TIMSK1 = _BV(TOIE1);
+
+#define BAUD CONFIG_UART0_BAUD
+#include <util/setbaud.h>
+	uart_init(
+		(UBRRH_VALUE << 8) |
+		(UBRRL_VALUE << 0) |
+		(USE_2X ? 0x8000 : 0));
+	stdout = &uart_stream;
+
+	sei();
+
+	// Set up the workloads
+	polyfs_init();
+	fs.fn_read = read_image;
+	crc_fs.fn_read = read_crc_image;
+	if (polyfs_fs_open(&fs) || polyfs_fs_open(&crc_fs)) {
+		printf_P(PSTR("bench: cannot open filesystem\n"));
+	}
+	setup_lzo();
+	settings_set_uint32(BENCH_SETTINGS_KEY, 0xdeadbeef);
+	pid_init(1 * SCALING_FACTOR, 0.5 * SCALING_FACTOR, 0, &pid);
+	tm_time = 1325376000; // 2012-01-01 00:00:00
+	gmtime(tm_time, &tm);
+	spi_init();
+
+	for (uint8_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		PGM_P name = (PGM_P)pgm_read_word(&benches[i].name);
+		void (*fn)(void) = (void *)pgm_read_word(&benches[i].fn);
+		uint16_t iterations = pgm_read_word(&benches[i].iterations);
+		uint32_t total;
+
+		total = run_bench(fn, iterations);
+
+		// Take off the cost of the loop and an empty call
+		if (fn != bench_nothing) {
+			total -= run_bench(bench_nothing, iterations);
+		}
+
+		printf_P(PSTR("bench\t%S\t%u\t%lu\t%lu\n"),
+			name, iterations, total, total / iterations);
+	}
+
+	uart_txwait();
+
+	// Sleeping with interrupts off makes simavr exit
+	cli();
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sleep_cpu();
+
+	return 0;
+}
@@ -44,15 +44,83 @@
 #define CMD_RD_SREG 0x05
 #define CMD_WR_SREG 0x01
 #define CMD_RD_MFR_DEV_ID 0x9f
+#define CMD_RD_SFDP 0x5a
 
 #define MFR_CONT_CODE 0x7f
-#define MFR_CT_ATMEL 0x00
 #define MFR_ID_ATMEL 0x1f
-#define DEV_ID_AT26DF081A_P1 0x45
-#define DEV_ID_AT26DF081A_P2 0x01
+#define MFR_ID_WINBOND 0xef
+
+// The dataflash runs in mode 0 at F_CPU/2
+#define SCK_FREQ (F_CPU / 2)
+
+// Largest part that can be addressed with three address bytes
+#define MAX_SIZE_SHIFT 24
+
+// Status register bits 5:2 as used for global protection on the AT26DF081A
+#define SREG_GLOBAL_MASK 0x3c
+#define SREG_GLOBAL_PROTECT 0x3c
+#define SREG_GLOBAL_UNPROTECT 0x00
+
+// Block protect bits that cover the whole array on parts without sector
+// protection (BP2:0 on the Winbond parts)
+#define SREG_BP_MASK 0x1c
+
+// Device flags
+#define DEV_SECTOR_PROT 0x01 // individual sector protection commands
+#define DEV_SECTOR_TABLE 0x02 // protection sectors as in sectors[]
+
+#define DATAFLASH_ERASE_ALL \
+	(DATAFLASH_ERASE_4K | DATAFLASH_ERASE_32K | DATAFLASH_ERASE_64K)
+
+struct dataflash_device {
+	uint8_t mfr_id;
+	uint8_t devid1;
+	uint8_t devid2;
+	uint8_t size_shift; // log2 of the size in bytes
+	uint8_t erase_sizes; // DATAFLASH_ERASE_*
+	uint8_t flags; // DEV_*
+	uint8_t max_sck_lf; // MHz, for CMD_RD_ARRAY_LF
+	uint8_t max_sck; // MHz, for CMD_RD_ARRAY
+};
+
+// Parts that are known to work, and what they can do. Anything else is
+// looked up through SFDP if that is enabled.
+static const struct dataflash_device devices[] PROGMEM = {
+	// Atmel AT26DF081A, 1MB
+	{ MFR_ID_ATMEL, 0x45, 0x01, 20, DATAFLASH_ERASE_ALL,
+		DEV_SECTOR_PROT | DEV_SECTOR_TABLE, 33, 70 },
+	// Atmel AT26DF161A, 2MB
+	{ MFR_ID_ATMEL, 0x46, 0x01, 21, DATAFLASH_ERASE_ALL,
+		DEV_SECTOR_PROT, 33, 70 },
+	// Atmel AT26DF321, 4MB
+	{ MFR_ID_ATMEL, 0x47, 0x00, 22, DATAFLASH_ERASE_ALL,
+		DEV_SECTOR_PROT, 33, 66 },
+	// Winbond W25Q80, W25Q16, W25Q32, W25Q64 and W25Q128, 1-16MB
+	{ MFR_ID_WINBOND, 0x40, 0x14, 20, DATAFLASH_ERASE_ALL, 0, 50, 104 },
+	{ MFR_ID_WINBOND, 0x40, 0x15, 21, DATAFLASH_ERASE_ALL, 0, 50, 104 },
+	{ MFR_ID_WINBOND, 0x40, 0x16, 22, DATAFLASH_ERASE_ALL, 0, 50, 104 },
+	{ MFR_ID_WINBOND, 0x40, 0x17, 23, DATAFLASH_ERASE_ALL, 0, 50, 104 },
+	{ MFR_ID_WINBOND, 0x40, 0x18, 24, DATAFLASH_ERASE_ALL, 0, 50, 104 },
+};
+
+#define NUM_DEVICES (sizeof(devices) / sizeof(struct dataflash_device))
+
+#if CONFIG_DRIVERS_DATAFLASH_SFDP
+#define SFDP_SIGNATURE 0x50444653UL // "SFDP"
+#define SFDP_JEDEC_BASIC 0x00
+
+// Dwords of the basic flash parameter table that are used
+#define SFDP_DWORDS 11
+
+// SFDP has no clock limits, so assume what any recent part can manage
+#define SFDP_MAX_SCK_LF 33
+#define SFDP_MAX_SCK 50
+#endif
 
-// size of dataflash in bytes
-#define FLASH_SIZE 1048576
+// Everything the rest of the driver uses is from here on
+#define FLASH_SIZE (geom.size)
+#define READ_CMD (geom.read_cmd)
+#define READ_DUMMY_BYTES (geom.read_dummy)
 
 static const dataflash_sector_t sectors[] PROGMEM = {
 	{ 0x00000, 0x0ffff }, //  0: 64K
@@ -76,56 +144,252 @@ static const dataflash_sector_t sectors[] PROGMEM = {
 	{ 0xf8000, 0xfffff }, // 18: 32K
 };
 
+#define NUM_SECTORS (sizeof(sectors) / sizeof(dataflash_sector_t))
+
+// Index of the sector holding the start of each sixteenth of the flash,
+// built from sectors[] so that a lookup only has to look at a few entries
+#define SECTOR_INDEX_SIZE 16
+static uint8_t sector_index[SECTOR_INDEX_SIZE];
+
 static struct {
 	int inited : 1;
+	uint8_t flags; // DEV_* for the part that was found
+	uint8_t index_shift; // address to sector_index[] entry
 } status;
 
-// Set up SPI and assert CS
+static dataflash_geometry_t geom;
+
+static const spi_device_t spi_dev = SPI_DEVICE(
+	CONFIG_DRIVERS_DATAFLASH_PORT, CONFIG_DRIVERS_DATAFLASH_CS,
+	SPI_MODE_0, SPI_CLOCK_DIV2);
+
+// Set the SPI bus up for the part and assert CS
 static inline void dev_assert(void) {
-	spi_init();
-	CONFIG_DRIVERS_DATAFLASH_PORT &= ~_BV(CONFIG_DRIVERS_DATAFLASH_CS);
+	spi_select(&spi_dev);
 }
 
-// Release CS and release SPI
+// Release CS
 static inline void dev_release(void) {
-	CONFIG_DRIVERS_DATAFLASH_PORT |= _BV(CONFIG_DRIVERS_DATAFLASH_CS);
-	spi_release();
+	spi_deselect(&spi_dev);
 }
 
 static inline void send_address(uint32_t addr) {
-	// Send 3 bytes (assume little endian)
-	for (int x = 2; x >= 0; x--) {
-		spi_rw(((uint8_t *)&addr)[x]);
+	// Send 3 bytes, MSB first (assume little endian)
+	uint8_t buf[3] = {
+		((uint8_t *)&addr)[2],
+		((uint8_t *)&addr)[1],
+		((uint8_t *)&addr)[0],
+	};
+
+	spi_write_block(buf, sizeof(buf));
+}
+
+// Copy an entry from the device table
+static void device_by_idx(uint8_t idx, struct dataflash_device *dev) {
+#if CONFIG_IMAGE_BOOTLOADER
+	uint_farptr_t addr = pgm_get_far_address(devices);
+
+	addr += idx * sizeof(*dev);
+	poly_memcpy_PF(dev, addr, sizeof(*dev));
+#else
+	memcpy_P(dev, &devices[idx], sizeof(*dev));
+#endif
+}
+
+#if CONFIG_DRIVERS_DATAFLASH_SFDP
+static void read_sfdp(uint32_t addr, void *buf, uint8_t bytes) {
+	// Start talking
+	dev_assert();
+
+	// Send command and address, followed by a dummy byte
+	spi_rw(CMD_RD_SFDP);
+	send_address(addr);
+	spi_rw(0x00);
+
+	// Read data
+	spi_read_block(buf, bytes);
+
+	// All done
+	dev_release();
+}
+
+// Fill in dev from the JEDEC basic flash parameter table
+static int probe_sfdp(struct dataflash_device *dev) {
+	uint32_t dw[SFDP_DWORDS];
+	uint8_t *hdr = (uint8_t *)dw;
+	uint8_t len;
+
+	// Read the SFDP header and the first parameter header
+	read_sfdp(0, dw, 16);
+	if (dw[0] != SFDP_SIGNATURE || hdr[8] != SFDP_JEDEC_BASIC) {
+		return -1;
+	}
+
+	// Read as much of the basic table as we need
+	len = hdr[11];
+	if (len < 2) {
+		return -1;
+	}
+	else if (len > SFDP_DWORDS) {
+		len = SFDP_DWORDS;
+	}
+	read_sfdp(dw[3] & 0xffffff, dw, len * 4);
+
+	// Density, in bits
+	if (dw[1] & 0x80000000UL) {
+		dev->size_shift = (dw[1] & 0x7fffffffUL) - 3;
+	}
+	else {
+		dev->size_shift = 0;
+		while (dw[1] >> dev->size_shift) {
+			dev->size_shift++;
+		}
+		dev->size_shift -= 3;
+	}
+
+	// Erase types, as long as they use the usual opcodes
+	dev->erase_sizes = 0;
+	if (len >= 9) {
+		for (uint8_t i = 0; i < 4; i++) {
+			uint8_t size = hdr[28 + i * 2];
+			uint8_t cmd = hdr[29 + i * 2];
+
+			if (size == 12 && cmd == CMD_ERASE_BLK_4K) {
+				dev->erase_sizes |= DATAFLASH_ERASE_4K;
+			}
+			else if (size == 15 && cmd == CMD_ERASE_BLK_32K) {
+				dev->erase_sizes |= DATAFLASH_ERASE_32K;
+			}
+			else if (size == 16 && cmd == CMD_ERASE_BLK_64K) {
+				dev->erase_sizes |= DATAFLASH_ERASE_64K;
+			}
+		}
 	}
+	else if ((hdr[0] & 0x03) == 0x01 && hdr[1] == CMD_ERASE_BLK_4K) {
+		dev->erase_sizes = DATAFLASH_ERASE_4K;
+	}
+
+	// Page size, if the table is new enough to have it
+	geom.page_size = len >= 11 ?
+		1 << ((dw[10] >> 4) & 0x0f) : DATAFLASH_WR_PAGE_SIZE;
+
+	dev->flags = 0;
+	dev->max_sck_lf = SFDP_MAX_SCK_LF;
+	dev->max_sck = SFDP_MAX_SCK;
+
+	return 0;
+}
+#endif
+
+// Work out what the part is and how to talk to it
+static int identify(struct dataflash_device *dev) {
+	dataflash_id_t id;
+	int ret;
+
+	// read device ID
+	ret = dataflash_read_id(&id, NULL, 0);
+	if (ret) {
+		return -1;
+	}
+
+	// look for it in the table
+	geom.page_size = DATAFLASH_WR_PAGE_SIZE;
+	for (uint8_t i = 0; i < NUM_DEVICES; i++) {
+		device_by_idx(i, dev);
+
+		if ((id.num_cont == 0) &&
+			(id.mfr_id == dev->mfr_id) &&
+			(id.devid1 == dev->devid1) &&
+			(id.devid2 == dev->devid2))
+		{
+			return 0;
+		}
+	}
+
+#if CONFIG_DRIVERS_DATAFLASH_SFDP
+	return probe_sfdp(dev);
+#else
+	return -1;
+#endif
 }
 
 static int dataflash_init(void) {
+	struct dataflash_device dev;
+	dataflash_sector_t sector;
+	uint8_t idx = 0;
+
 	// Make sure CS is pulled high (release device)
 	CONFIG_DRIVERS_DATAFLASH_DDR |= _BV(CONFIG_DRIVERS_DATAFLASH_CS);
 	CONFIG_DRIVERS_DATAFLASH_PORT |= _BV(CONFIG_DRIVERS_DATAFLASH_CS);
 
-	// read device ID
-	dataflash_id_t id;
-	int ret = dataflash_read_id(&id, NULL, 0);
-	if (ret) {
+	// find out what's there
+	if (identify(&dev)) {
 		return -1;
 	}
 
-	// check device ID matches what we expect
-	if ((id.num_cont != MFR_CT_ATMEL) ||
-		(id.mfr_id != MFR_ID_ATMEL) ||
-		(id.devid1 != DEV_ID_AT26DF081A_P1) ||
-		(id.devid2 != DEV_ID_AT26DF081A_P2))
-	{
+	// Programs are done in DATAFLASH_WR_PAGE_SIZE pieces at most
+	if (geom.page_size < DATAFLASH_WR_PAGE_SIZE) {
+		return -1;
+	}
+
+	// Anything under 64K can't be split into sectors
+	if (dev.size_shift < 16) {
 		return -1;
 	}
 
+	// Larger parts need four address bytes; just use the start of them
+	if (dev.size_shift > MAX_SIZE_SHIFT) {
+		dev.size_shift = MAX_SIZE_SHIFT;
+	}
+	geom.size = (uint32_t)1 << dev.size_shift;
+	geom.erase_sizes = dev.erase_sizes;
+	status.flags = dev.flags;
+	status.index_shift = dev.size_shift - 4;
+
+	// Pick a read opcode that works at our SPI clock
+#if CONFIG_DRIVERS_DATAFLASH_FAST_READ
+	if (SCK_FREQ <= dev.max_sck * 1000000UL) {
+#else
+	if (SCK_FREQ <= dev.max_sck_lf * 1000000UL) {
+		geom.read_cmd = CMD_RD_ARRAY_LF;
+		geom.read_dummy = 0;
+		geom.max_sck_mhz = dev.max_sck_lf;
+	}
+	else if (SCK_FREQ <= dev.max_sck * 1000000UL) {
+#endif
+		geom.read_cmd = CMD_RD_ARRAY;
+		geom.read_dummy = 1;
+		geom.max_sck_mhz = dev.max_sck;
+	}
+	else {
+		return -1;
+	}
+
+	// Build the sector index
+	if (status.flags & DEV_SECTOR_TABLE) {
+		for (uint8_t i = 0; i < sizeof(sector_index); i++) {
+			uint32_t addr = (uint32_t)i << status.index_shift;
+
+			while (!dataflash_sector_by_idx(idx, &sector) &&
+				sector.end < addr)
+			{
+				idx++;
+			}
+
+			sector_index[i] = idx;
+		}
+	}
+
 	// save state
 	status.inited = 1;
 
 	return 0;
 }
 
+const dataflash_geometry_t *dataflash_geometry(void) {
+	return status.inited ? &geom : NULL;
+}
+
 int dataflash_read_id(dataflash_id_t *id, uint8_t *extinfo, uint8_t bufsz) {
 	uint8_t val;
 	id->num_cont = 0;
@@ -163,9 +427,7 @@ int dataflash_read_id(dataflash_id_t *id, uint8_t *extinfo, uint8_t bufsz) {
 
 	// Read the extended info string into the supplied buffer
 	uint8_t read = bufsz < id->extinfo_len ? bufsz : id->extinfo_len;
-	while (read--) {
-		*extinfo++ = spi_rw(0x00);
-	}
+	spi_read_block(extinfo, read);
 
 	// All done
 	dev_release();
@@ -173,9 +435,23 @@ int dataflash_read_id(dataflash_id_t *id, uint8_t *extinfo, uint8_t bufsz) {
 	return 0;
 }
 
+// Index of the first sector that could hold addr
+static uint8_t first_sector(uint32_t addr) {
+	if (status.flags & DEV_SECTOR_TABLE) {
+		return sector_index[addr >> status.index_shift];
+	}
+
+	return addr >> 16;
+}
+
 int dataflash_sector_from_addr(uint32_t addr, dataflash_sector_t *sector) {
-	// Loop through the table of sectors
-	for (int i = 0; i < (sizeof(sectors) / sizeof(dataflash_sector_t)); i++) {
+	// Check the address is within bounds
+	if (addr >= FLASH_SIZE) {
+		return -1;
+	}
+
+	// Start from the first sector in this part of the flash
+	for (uint8_t i = first_sector(addr); ; i++) {
 		// Copy the array entry into the buffer
 		int ret = dataflash_sector_by_idx(i, sector);
 		if (ret) {
@@ -183,19 +459,56 @@ int dataflash_sector_from_addr(uint32_t addr, dataflash_sector_t *sector) {
 		}
 
 		// Is this the entry we're after?
-		if ((sector->start <= addr) && 
-			(sector->end >= addr))
-		{
+		if (sector->end >= addr) {
 			return 0;
 		}
 	}
+}
 
-	return -1;
+int dataflash_sector_range(uint32_t start, uint32_t end,
+	int (*fn)(const dataflash_sector_t *sector, void *arg), void *arg)
+{
+	dataflash_sector_t sector;
+	int ret;
+
+	// Check the range is within bounds
+	if (start >= FLASH_SIZE || end < start) {
+		return -1;
+	}
+
+	// Walk through the sectors from the first one in the range
+	for (uint16_t i = first_sector(start);
+		i <= 0xff && !dataflash_sector_by_idx(i, &sector) &&
+		sector.start <= end; i++)
+	{
+		if (sector.end < start) {
+			continue;
+		}
+
+		ret = fn(&sector, arg);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
 int dataflash_sector_by_idx(uint8_t idx, dataflash_sector_t *sector) {
+	// Parts without a table have uniform 64K sectors
+	if (!(status.flags & DEV_SECTOR_TABLE)) {
+		if (idx >= (FLASH_SIZE >> 16)) {
+			return -1;
+		}
+
+		sector->start = (uint32_t)idx << 16;
+		sector->end = sector->start + DATAFLASH_SECTOR_64K_SIZE - 1;
+
+		return 0;
+	}
+
 	// Check the index isn't too large
-	if (idx >= (sizeof(sectors) / sizeof(dataflash_sector_t))) {
+	if (idx >= NUM_SECTORS) {
 		return -1;
 	}
 
@@ -238,11 +551,34 @@ int dataflash_read_status(uint8_t *sreg) {
 }
 
 int dataflash_write_status(uint8_t sreg) {
+	uint8_t cur;
+	int err;
+
 	// Make sure init has been called
 	if (!status.inited) {
 		return -1;
 	}
 
+	// Parts with only block protection get the global protect and
+	// unprotect behaviour of the AT26DF081A
+	if (!(status.flags & DEV_SECTOR_PROT)) {
+		if ((sreg & SREG_GLOBAL_MASK) == SREG_GLOBAL_PROTECT) {
+			sreg = (sreg & ~SREG_GLOBAL_MASK) | SREG_BP_MASK;
+		}
+		else if ((sreg & SREG_GLOBAL_MASK) != SREG_GLOBAL_UNPROTECT) {
+			// Leave the protection as it is
+			err = dataflash_read_status(&cur);
+			if (err) {
+				return err;
+			}
+
+			sreg = (sreg & ~SREG_GLOBAL_MASK) | (cur & SREG_GLOBAL_MASK);
+		}
+
+		// Bit 7 is SRP0 on these parts, which can lock SREG for good
+		sreg &= ~DATAFLASH_SREG_SPRL;
+	}
+
 	// Start talking
 	dev_assert();
 
@@ -255,6 +591,12 @@ int dataflash_write_status(uint8_t sreg) {
 	// All done
 	dev_release();
 
+	// The Winbond parts take a write cycle for this, and ignore WREN,
+	// WRSR and erase commands until it's over
+	if (!(status.flags & DEV_SECTOR_PROT)) {
+		return dataflash_wait_ready();
+	}
+
 	return 0;
 }
 
@@ -283,6 +625,18 @@ int dataflash_wait_ready(void) {
 	return 0;
 }
 
+int dataflash_busy(void) {
+	uint8_t sreg;
+	int err;
+
+	err = dataflash_read_status(&sreg);
+	if (err) {
+		return err;
+	}
+
+	return (sreg & DATAFLASH_SREG_BUSY) ? 1 : 0;
+}
+
 int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes) {
 	uint8_t *cbuf = (uint8_t *)buf;
 
@@ -306,14 +660,23 @@ int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes) {
 	dev_assert();
 
 	// Send command
-	spi_rw(CMD_RD_ARRAY_LF); // "low frequency" is 33 MHz or less
+	spi_rw(READ_CMD);
 
 	// Send address
 	send_address(offset);
 
-	// Read data
-	for (uint32_t i = 0; i < bytes; i++) {
-		*(cbuf++) = spi_rw(0x00);
+	// Fast reads need a dummy byte before the data
+	for (uint8_t i = 0; i < READ_DUMMY_BYTES; i++) {
+		spi_rw(0x00);
+	}
+
+	// Read data, in chunks that fit the loop counter
+	for (uint32_t left = bytes; left; ) {
+		uint16_t chunk = left > 0x8000 ? 0x8000 : left;
+
+		spi_read_block(cbuf, chunk);
+		cbuf += chunk;
+		left -= chunk;
 	}
 
 	// All done
@@ -322,6 +685,47 @@ int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes) {
 	return bytes;
 }
 
+int dataflash_check_blank(uint32_t offset, uint32_t bytes) {
+	uint8_t blank = 0xff;
+
+	// Make sure init has been called
+	if (!status.inited) {
+		return -1;
+	}
+
+	// Sanity-check the inputs
+	if (offset >= FLASH_SIZE) {
+		return -1;
+	}
+	else if (offset + bytes > FLASH_SIZE) {
+		bytes = FLASH_SIZE - offset;
+	}
+
+	// Start talking
+	dev_assert();
+
+	// Send command
+	spi_rw(READ_CMD);
+
+	// Send address
+	send_address(offset);
+
+	// Fast reads need a dummy byte before the data
+	for (uint8_t i = 0; i < READ_DUMMY_BYTES; i++) {
+		spi_rw(0x00);
+	}
+
+	// Stop at the first byte that has been programmed
+	while (bytes-- && blank == 0xff) {
+		blank &= spi_rw(0xff);
+	}
+
+	// All done
+	dev_release();
+
+	return blank == 0xff;
+}
+
 int dataflash_write_enable(void) {
 	// Make sure init has been called
 	if (!status.inited) {
@@ -390,6 +794,11 @@ int dataflash_protect_sector(uint32_t addr) {
 		return -1;
 	}
 
+	// Parts without sector protection can only lock everything
+	if (!(status.flags & DEV_SECTOR_PROT)) {
+		return dataflash_write_status(SREG_GLOBAL_PROTECT);
+	}
+
 	// Start talking
 	dev_assert();
 
@@ -437,6 +846,11 @@ int dataflash_unprotect_sector(uint32_t addr) {
 		return -1;
 	}
 
+	// Parts without sector protection can only unlock everything
+	if (!(status.flags & DEV_SECTOR_PROT)) {
+		return dataflash_write_status(SREG_GLOBAL_UNPROTECT);
+	}
+
 	// Start talking
 	dev_assert();
 
@@ -453,6 +867,9 @@ int dataflash_unprotect_sector(uint32_t addr) {
 }
 
 int dataflash_read_protection(uint32_t addr, uint8_t *value) {
+	uint8_t sreg;
+	int err;
+
 	// Make sure init has been called
 	if (!status.inited) {
 		return -1;
@@ -463,6 +880,18 @@ int dataflash_read_protection(uint32_t addr, uint8_t *value) {
 		return -1;
 	}
 
+	// Without sector protection, treat any block protection as covering
+	// every sector
+	if (!(status.flags & DEV_SECTOR_PROT)) {
+		err = dataflash_read_status(&sreg);
+		if (err) {
+			return err;
+		}
+
+		*value = (sreg & SREG_BP_MASK) ? 0xff : 0x00;
+		return 0;
+	}
+
 	// Start talking
 	dev_assert();
 
@@ -481,6 +910,26 @@ int dataflash_read_protection(uint32_t addr, uint8_t *value) {
 	return 0;
 }
 
+// Fail if the sector is protected; for use with dataflash_sector_range()
+static int check_unprotected(const dataflash_sector_t *sector, void *arg) {
+	uint8_t temp;
+	int err;
+
+	// Read sector protection information
+	err = dataflash_read_protection(sector->start, &temp);
+	if (err) {
+		return err;
+	}
+
+	// Check that the sector isn't protected
+	if (temp != 0x00) {
+		dataflash_write_disable();
+		return -1;
+	}
+
+	return 0;
+}
+
 int dataflash_erase_4k(uint32_t addr) {
 	int err;
 	uint8_t temp;
@@ -495,6 +944,11 @@ int dataflash_erase_4k(uint32_t addr) {
 		return -1;
 	}
 
+	// Check the part can erase blocks of this size
+	if (!(geom.erase_sizes & DATAFLASH_ERASE_4K)) {
+		return -1;
+	}
+
 	// Read sector protection information
 	err = dataflash_read_protection(addr, &temp);
 	if (err) {
@@ -538,7 +992,6 @@ int dataflash_erase_32k(uint32_t addr) {
 	uint8_t temp;
 	uint32_t start = addr & DATAFLASH_SECTOR_32K_MASK;
 	uint32_t end = start + DATAFLASH_SECTOR_32K_SIZE;
-	dataflash_sector_t sector;
 
 	// Make sure init has been called
 	if (!status.inited) {
@@ -550,28 +1003,16 @@ int dataflash_erase_32k(uint32_t addr) {
 		return -1;
 	}
 
-	// Find the sector information for the address
-	dataflash_sector_from_addr(start, &sector);
+	// Check the part can erase blocks of this size
+	if (!(geom.erase_sizes & DATAFLASH_ERASE_32K)) {
+		return -1;
+	}
 
 	// Go through all the sectors in this erase block
-	do {
-		// Read sector protection information
-		err = dataflash_read_protection(sector.start, &temp);
-		if (err) {
-			return err;
-		}
-
-		// Check that the sector isn't protected
-		if (temp != 0x00) {
-			dataflash_write_disable();
-			return -1;
-		}
-
-		// Get the next sector info
-		if (dataflash_sector_from_addr(sector.end + 1, &sector)) {
-			break;
-		}
-	} while (sector.end < end);
+	err = dataflash_sector_range(start, end - 1, check_unprotected, NULL);
+	if (err) {
+		return err;
+	}
 
 	// Get the current device status
 	err = dataflash_read_status(&temp);
@@ -604,7 +1045,6 @@ int dataflash_erase_64k(uint32_t addr) {
 	uint8_t temp;
 	uint32_t start = addr & DATAFLASH_SECTOR_64K_MASK;
 	uint32_t end = start + DATAFLASH_SECTOR_64K_SIZE;
-	dataflash_sector_t sector;
 
 	// Make sure init has been called
 	if (!status.inited) {
@@ -616,28 +1056,16 @@ int dataflash_erase_64k(uint32_t addr) {
 		return -1;
 	}
 
-	// Find the sector information for the address
-	dataflash_sector_from_addr(start, &sector);
+	// Check the part can erase blocks of this size
+	if (!(geom.erase_sizes & DATAFLASH_ERASE_64K)) {
+		return -1;
+	}
 
 	// Go through all the sectors in this erase block
-	do {
-		// Read sector protection information
-		err = dataflash_read_protection(sector.start, &temp);
-		if (err) {
-			return err;
-		}
-
-		// Check that the sector isn't protected
-		if (temp != 0x00) {
-			dataflash_write_disable();
-			return -1;
-		}
-
-		// Get the next sector info
-		if (dataflash_sector_from_addr(sector.end + 1, &sector)) {
-			break;
-		}
-	} while (sector.end < end);
+	err = dataflash_sector_range(start, end - 1, check_unprotected, NULL);
+	if (err) {
+		return err;
+	}
 
 	// Get the current device status
 	err = dataflash_read_status(&temp);
@@ -764,9 +1192,7 @@ int dataflash_write_data(const void *buf, uint32_t addr, uint16_t bytes) {
 	send_address(addr);
 
 	// Write data
-	for (uint16_t i = 0; i < bytes; i++) {
-		spi_rw(*(cbuf++));
-	}
+	spi_write_block(cbuf, bytes);
 
 	// All done
 	dev_release();
@@ -52,18 +52,48 @@ typedef struct {
 #define DATAFLASH_SECTOR_64K_SIZE ((uint32_t)1 << 16)
 #define DATAFLASH_SECTOR_64K_MASK (~(DATAFLASH_SECTOR_64K_SIZE - 1))
 
+#define DATAFLASH_ERASE_4K 0x01
+#define DATAFLASH_ERASE_32K 0x02
+#define DATAFLASH_ERASE_64K 0x04
+
+// Geometry of the part, found when the driver is initialised
+typedef struct {
+	uint32_t size; // in bytes
+	uint16_t page_size; // program page, at least DATAFLASH_WR_PAGE_SIZE
+	uint8_t erase_sizes; // DATAFLASH_ERASE_* that the part supports
+	uint8_t read_cmd; // read opcode in use
+	uint8_t read_dummy; // dummy bytes between the address and data
+	uint8_t max_sck_mhz; // fastest SPI clock for read_cmd
+} dataflash_geometry_t;
+
+// Returns NULL if the part wasn't recognised
+const dataflash_geometry_t *dataflash_geometry(void);
+
 int dataflash_read_id(dataflash_id_t *id, uint8_t *extinfo, uint8_t bufsz);
 
 // For sector protection sectors only
 int dataflash_sector_from_addr(uint32_t addr, dataflash_sector_t *sector);
 int dataflash_sector_by_idx(uint8_t idx, dataflash_sector_t *sector);
 
+// Calls fn for each protection sector that overlaps [start, end], in
+// order. Stops early and returns fn's result if it returns non-zero.
+int dataflash_sector_range(uint32_t start, uint32_t end,
+	int (*fn)(const dataflash_sector_t *sector, void *arg), void *arg);
+
 int dataflash_read_status(uint8_t *sreg);
 int dataflash_write_status(uint8_t sreg);
 int dataflash_wait_ready(void);
 
+// Returns 1 while an erase or program is in progress, 0 once the device is
+// ready. The erase and write functions below only start the operation, so
+// this can be polled instead of blocking in dataflash_wait_ready().
+int dataflash_busy(void);
+
 int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes);
 
+// Returns 1 if every byte in the range is erased (0xff), 0 if not
+int dataflash_check_blank(uint32_t offset, uint32_t bytes);
+
 int dataflash_write_enable(void);
 int dataflash_write_disable(void);
 int dataflash_protect_sector(uint32_t addr);
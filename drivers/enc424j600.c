@@ -40,9 +40,28 @@
 // Promiscuous mode, uncomment if you want to receive all packets, even those which are not for you
 // #define PROMISCUOUS_MODE
 
+// Registers below this address are banked, the rest need the unbanked ops
+#define BANKED_LIMIT		(0x80u)
+
 // Internal MAC level variables and flags.
 static uint8_t currentBank;
 static uint16_t nextPacketPointer;
+static uint16_t rxFrame;
+
+// TX slot that packets are written to, and the one being transmitted
+static uint16_t txSlot;
+static uint16_t txBusy;
+
+// Shadow copies of registers, to save reading them back over SPI
+static uint16_t macon2;
+static uint8_t linkUp;
+static uint8_t linkChanged;
+static uint16_t rxAborts;
+
+// The ENC424J600 is good for 14MHz in mode 0
+static const spi_device_t spi_dev = SPI_DEVICE(
+	ENC424J600_CONTROL_PORT, ENC424J600_CONTROL_CS,
+	SPI_MODE_0, SPI_CLOCK_DIV2);
 
 
 void enc424j600Init(void);
@@ -52,6 +71,10 @@ void enc424j600GetMACAddr(uint8_t addr[6]);
 
 void enc424j600MACFlush(void);
 static void enc424j600SendSystemReset(void);
+static void enc424j600CheckLink(void);
+static void enc424j600TxWait(void);
+static void enc424j600SelectBank(uint16_t address);
+static uint16_t enc424j600DMAChecksum(uint16_t start, uint16_t len, uint16_t seed);
 uint16_t enc424j600ReadReg(uint16_t address);
 void enc424j600WriteReg(uint16_t address, uint16_t data);
 uint16_t enc424j600ReadPHYReg(uint8_t address);
@@ -83,6 +106,8 @@ void enc424j600Init(void) {
 
 	// Initialize RX tracking variables and other control state flags
 	nextPacketPointer = ENC424J600_RXSTART;
+	txSlot = ENC424J600_TXSTART;
+	txBusy = ENC424J600_RAMSIZE;
 
 	// Set up TX/RX/UDA buffer addresses
 	enc424j600WriteReg(ETXST, ENC424J600_TXSTART);
@@ -101,8 +126,20 @@ void enc424j600Init(void) {
 	// and symmetric PAUSE capability
 	enc424j600WritePHYReg(PHANA, PHANA_ADPAUS0 | PHANA_AD10FD | PHANA_AD10 | PHANA_AD100FD | PHANA_AD100 | PHANA_ADIEEE0);
 
+	// Prime the shadow registers, and have the first status check look at
+	// the PHY
+	macon2 = enc424j600ReadReg(MACON2);
+	linkUp = (enc424j600ReadReg(ESTAT) & ESTAT_PHYLNK) ? 1 : 0;
+	linkChanged = 1;
+
+#ifdef CONFIG_DRIVERS_ENC424J600_INT_VECT
+	// Assert INT while there are packets waiting to be read, or when the
+	// link changes
+	enc424j600WriteReg(EIE, EIE_INTIE | EIE_PKTIE | EIE_LINKIE);
+#endif
+
 	// Enable RX packet reception
-	enc424j600BFSReg(ECON1, ECON1_RXEN);
+	enc424j600ExecuteOp0(ENABLERX);
 }
 
 /********************************************************************
@@ -121,7 +158,7 @@ static void enc424j600SendSystemReset(void) {
 			enc424j600WriteReg(EUDAST, 0x1234);
 		} while (enc424j600ReadReg(EUDAST) != 0x1234);
 		// Issue a reset and wait for it to complete
-		enc424j600BFSReg(ECON2, ECON2_ETHRST);
+		enc424j600ExecuteOp0(SETETHRST);
 		currentBank = 0; while ((enc424j600ReadReg(ESTAT) & (ESTAT_CLKRDY | ESTAT_RSTDONE | ESTAT_PHYRDY)) != (ESTAT_CLKRDY | ESTAT_RSTDONE | ESTAT_PHYRDY));
 		_delay_us(300);
 		// Check to see if the reset operation was successful by
@@ -139,17 +176,48 @@ static void enc424j600SendSystemReset(void) {
  * ******************************************************************/
 
 uint16_t enc424j600PacketReceive(uint16_t len, uint8_t* packet) {
-	uint16_t newRXTail;
-	RXSTATUS statusVector;
-
 	if (!(enc424j600ReadReg(EIR) & EIR_PKTIF)) {
 		return 0;
 	}
 
+	return enc424j600PacketRead(len, packet);
+}
+
+/**
+ * Number of received packets waiting in the RX buffer
+ * @return <uint8_t> count - ESTAT.PKTCNT, saturates at 255
+ */
+uint8_t enc424j600PacketCount(void) {
+	return enc424j600ReadReg(ESTAT) & 0xff;
+}
+
+/**
+ * Read the next packet, which must be known to be there from
+ * enc424j600PacketCount(). Returns 0 for packets too big for the buffer,
+ * which are dropped.
+ */
+uint16_t enc424j600PacketRead(uint16_t len, uint8_t* packet) {
+	len = enc424j600PacketCopy(len, packet);
+	enc424j600PacketRelease();
+
+	return len;
+}
+
+/**
+ * Like enc424j600PacketRead(), but leaves the packet in the RX buffer so
+ * that enc424j600RxChecksum() can look at it. Call enc424j600PacketRelease()
+ * once done with it.
+ */
+uint16_t enc424j600PacketCopy(uint16_t len, uint8_t* packet) {
+	RXSTATUS statusVector;
 
 	// Set the RX Read Pointer to the beginning of the next unprocessed packet
-	enc424j600WriteReg(ERXRDPT, nextPacketPointer);
+	enc424j600ExecuteOp16(WRXRDPT, nextPacketPointer);
 
+	// The frame itself follows the next packet pointer and status vector
+	rxFrame = nextPacketPointer + sizeof (nextPacketPointer) + sizeof (statusVector);
+	if (rxFrame >= ENC424J600_RAMSIZE)
+		rxFrame -= ENC424J600_RAMSIZE - ENC424J600_RXSTART;
 
 	enc424j600ReadMemoryWindow(RX_WINDOW, (uint8_t*) & nextPacketPointer, sizeof (nextPacketPointer));
 	enc424j600ReadMemoryWindow(RX_WINDOW, (uint8_t*) & statusVector, sizeof (statusVector));
@@ -157,30 +225,108 @@ uint16_t enc424j600PacketReceive(uint16_t len, uint8_t* packet) {
 	len = (statusVector.bits.ByteCount <= len + 4) ? statusVector.bits.ByteCount - 4 : 0;
 	enc424j600ReadMemoryWindow(RX_WINDOW, packet, len);
 
+	return len;
+}
+
+/**
+ * Free the space taken by the packet last read with enc424j600PacketCopy()
+ */
+void enc424j600PacketRelease(void) {
+	uint16_t newRXTail;
+
 	newRXTail = nextPacketPointer - 2;
 	//Special situation if nextPacketPointer is exactly RXSTART
 	if (nextPacketPointer == ENC424J600_RXSTART)
 		newRXTail = ENC424J600_RAMSIZE - 2;
 
 	//Packet decrement
-	enc424j600BFSReg(ECON1, ECON1_PKTDEC);
+	enc424j600ExecuteOp0(SETPKTDEC);
 
 	//Write new RX tail
 	enc424j600WriteReg(ERXTAIL, newRXTail);
+}
 
-	return len;
+/**
+ * Checksum part of the packet last read with enc424j600PacketCopy()
+ * @variable <uint16_t> offset - where to start, from the start of the frame
+ * @variable <uint16_t> len - number of bytes to sum
+ * @variable <uint16_t> seed - one's complement sum to start from, host order
+ * @return <uint16_t> checksum - complement of the sum in host order, 0 if
+ * the data already held a correct checksum
+ */
+uint16_t enc424j600RxChecksum(uint16_t offset, uint16_t len, uint16_t seed) {
+	uint16_t start = rxFrame + offset;
+
+	// The DMA wraps at the end of the RX buffer by itself, but the start
+	// address needs doing by hand
+	if (start >= ENC424J600_RAMSIZE)
+		start -= ENC424J600_RAMSIZE - ENC424J600_RXSTART;
+
+	return enc424j600DMAChecksum(start, len, seed);
 }
 
 void enc424j600PacketSend(uint16_t len, uint8_t* packet) {
-	// Set the Window Write Pointer to the beginning of the transmit buffer
+	enc424j600PacketWrite(len, packet);
+	enc424j600PacketTransmit(len);
+}
+
+/**
+ * Choose the TX slot used by the functions below. Each of the
+ * ENC424J600_TX_SLOTS slots holds one packet, which stays there after
+ * being sent until something else is written to the slot.
+ * @variable <uint8_t> slot - 0 to ENC424J600_TX_SLOTS - 1
+ */
+void enc424j600TxSelect(uint8_t slot) {
+	txSlot = ENC424J600_TXSTART + slot * ENC424J600_TX_SLOT_SIZE;
+}
+
+static void enc424j600TxWait(void) {
+	// The MAC sends one packet at a time
+	while (enc424j600ReadReg(ECON1) & ECON1_TXRTS);
+}
+
+/**
+ * Copy a packet into the TX slot without sending it, so that it can be
+ * checksummed and patched first
+ */
+void enc424j600PacketWrite(uint16_t len, uint8_t* packet) {
+	// Don't overwrite a packet while it's going out
+	if (txSlot == txBusy)
+		enc424j600TxWait();
+
+	// Set the Window Write Pointer to the beginning of the slot
+	enc424j600ExecuteOp16(WGPWRPT, txSlot);
 	enc424j600WriteMemoryWindow(GP_WINDOW, packet, len);
+}
 
-	enc424j600WriteReg(EGPWRPT, ENC424J600_TXSTART);
-	enc424j600WriteReg(ETXLEN, len);
+/**
+ * Overwrite part of the packet in the TX slot
+ * @variable <uint16_t> offset - where to write, from the start of the frame
+ */
+void enc424j600PacketPatch(uint16_t offset, uint8_t* data, uint16_t len) {
+	enc424j600ExecuteOp16(WGPWRPT, txSlot + offset);
+	enc424j600WriteMemoryWindow(GP_WINDOW, data, len);
+}
 
-	enc424j600MACFlush();
+/**
+ * Checksum part of the packet in the TX slot, as enc424j600RxChecksum()
+ */
+uint16_t enc424j600TxChecksum(uint16_t offset, uint16_t len, uint16_t seed) {
+	return enc424j600DMAChecksum(txSlot + offset, len, seed);
+}
 
+/**
+ * Send the packet in the TX slot, once the last one has gone. This can also
+ * send a packet again, as long as its slot hasn't been reused.
+ */
+void enc424j600PacketTransmit(uint16_t len) {
+	enc424j600TxWait();
 
+	enc424j600WriteReg(ETXST, txSlot);
+	enc424j600WriteReg(ETXLEN, len);
+	txBusy = txSlot;
+
+	enc424j600MACFlush();
 }
 
 void enc424j600GetMACAddr(uint8_t mac_addr[6]) {
@@ -197,31 +343,69 @@ void enc424j600GetMACAddr(uint8_t mac_addr[6]) {
 	mac_addr[5] = ((uint8_t*) & regValue)[1];
 }
 
-void enc424j600MACFlush(void) {
-	uint16_t w;
+/**
+ * Whether the link has gone up or down since the last call
+ * @return <uint8_t> changed - nonzero if the PHY status should be read again
+ */
+uint8_t enc424j600LinkChanged(void) {
+	uint8_t changed;
+
+	enc424j600CheckLink();
+
+	changed = linkChanged;
+	linkChanged = 0;
+
+	return changed;
+}
+
+/**
+ * Number of packets dropped for lack of RX buffer space, as of the last
+ * call to enc424j600LinkChanged() or a transmit
+ */
+uint16_t enc424j600RxAborts(void) {
+	return rxAborts;
+}
+
+static void enc424j600CheckLink(void) {
+	uint16_t eir, estat;
+
+	eir = enc424j600ReadReg(EIR);
+
+	if (eir & EIR_RXABTIF) {
+		enc424j600BFCReg(EIR, EIR_RXABTIF);
+		rxAborts++;
+	}
+
+	if (!(eir & EIR_LINKIF)) {
+		return;
+	}
+
+	enc424j600BFCReg(EIR, EIR_LINKIF);
+	linkChanged = 1;
+
+	estat = enc424j600ReadReg(ESTAT);
+	linkUp = (estat & ESTAT_PHYLNK) ? 1 : 0;
+
+	// Update MAC duplex settings to match PHY duplex setting
+	if (estat & ESTAT_PHYDPX) {
+		// Switching to full duplex
+		enc424j600WriteReg(MABBIPG, 0x15);
+		macon2 |= MACON2_FULDPX;
+	} else {
+		// Switching to half duplex
+		enc424j600WriteReg(MABBIPG, 0x12);
+		macon2 &= ~MACON2_FULDPX;
+	}
+	enc424j600WriteReg(MACON2, macon2);
+}
 
+void enc424j600MACFlush(void) {
 	// Check to see if the duplex status has changed.  This can
 	// change if the user unplugs the cable and plugs it into a
 	// different node.  Auto-negotiation will automatically set
 	// the duplex in the PHY, but we must also update the MAC
 	// inter-packet gap timing and duplex state to match.
-	if (enc424j600ReadReg(EIR) & EIR_LINKIF) {
-		enc424j600BFCReg(EIR, EIR_LINKIF);
-
-		// Update MAC duplex settings to match PHY duplex setting
-		w = enc424j600ReadReg(MACON2);
-		if (enc424j600ReadReg(ESTAT) & ESTAT_PHYDPX) {
-			// Switching to full duplex
-			enc424j600WriteReg(MABBIPG, 0x15);
-			w |= MACON2_FULDPX;
-		} else {
-			// Switching to half duplex
-			enc424j600WriteReg(MABBIPG, 0x12);
-			w &= ~MACON2_FULDPX;
-		}
-		enc424j600WriteReg(MACON2, w);
-	}
-
+	enc424j600CheckLink();
 
 	// Start the transmission, but only if we are linked.  Supressing
 	// transmissing when unlinked is necessary to avoid stalling the TX engine
@@ -231,8 +415,89 @@ void enc424j600MACFlush(void) {
 	// ultimately stall the Microchip TCP/IP stack since there is blocking code
 	// elsewhere in other files that expect the TX engine to always self-free
 	// itself very quickly.
-	if (enc424j600ReadReg(ESTAT) & ESTAT_PHYLNK)
-		enc424j600BFSReg(ECON1, ECON1_TXRTS);
+	if (linkUp)
+		enc424j600ExecuteOp0(SETTXRTS);
+}
+
+/**
+ * Have the DMA engine checksum a region of SRAM. EDMACS holds sums with the
+ * first byte on the wire in the low byte, and a seed in the same form as a
+ * result, i.e. complemented.
+ */
+static uint16_t enc424j600DMAChecksum(uint16_t start, uint16_t len, uint16_t seed) {
+	uint16_t sum;
+
+	seed = ~seed;
+	enc424j600WriteReg(EDMAST, start);
+	enc424j600WriteReg(EDMALEN, len);
+	enc424j600WriteReg(EDMACS, (seed << 8) | (seed >> 8));
+	enc424j600ExecuteOp0(DMACKSUMS);
+
+	while (enc424j600ReadReg(ECON1) & ECON1_DMAST);
+
+	sum = enc424j600ReadReg(EDMACS);
+	return (sum << 8) | (sum >> 8);
+}
+
+/********************************************************************
+ * RX FILTERS
+ * ******************************************************************/
+
+/**
+ * Set which packets are let into the RX buffer
+ * @variable <uint16_t> erxfcon - ERXFCON_* filters to enable
+ */
+void enc424j600SetRxFilter(uint16_t erxfcon) {
+	enc424j600WriteReg(ERXFCON, erxfcon);
+}
+
+void enc424j600HashClear(void) {
+	enc424j600WriteReg(EHT1, 0);
+	enc424j600WriteReg(EHT2, 0);
+	enc424j600WriteReg(EHT3, 0);
+	enc424j600WriteReg(EHT4, 0);
+}
+
+/**
+ * Let packets for a (multicast) address through the hash table filter
+ * @variable <uint8_t[6]> addr - destination MAC address
+ */
+void enc424j600HashAdd(const uint8_t addr[6]) {
+	uint32_t crc = 0xffffffff;
+	uint8_t bit;
+
+	// CRC-32 of the address, as for the FCS but without the final inversion
+	for (uint8_t i = 0; i < 6; i++) {
+		uint8_t data = addr[i];
+
+		for (uint8_t j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (((crc ^ data) & 1) ? 0xedb88320 : 0);
+			data >>= 1;
+		}
+	}
+
+	// Bits 28:23 pick one of the 64 bits in EHT1 to EHT4
+	bit = (crc >> 23) & 0x3f;
+	enc424j600BFSReg(EHT1 + ((bit >> 4) << 1), (uint16_t)1 << (bit & 0x0f));
+}
+
+/**
+ * Set up the pattern match filter. Bit n of the mask selects byte n of the
+ * 64 bytes from offset; the checksum of the selected bytes, taken in order
+ * as for an IP checksum, must equal checksum.
+ * @variable <uint16_t> offset - start of the window, from the start of the frame
+ * @variable <uint16_t[4]> mask - bytes to check, EPMM1 first
+ * @variable <uint16_t> checksum - complement of their sum, in host order
+ */
+void enc424j600SetPattern(uint16_t offset, const uint16_t mask[4], uint16_t checksum) {
+	enc424j600WriteReg(EPMO, offset);
+	enc424j600WriteReg(EPMM1, mask[0]);
+	enc424j600WriteReg(EPMM2, mask[1]);
+	enc424j600WriteReg(EPMM3, mask[2]);
+	enc424j600WriteReg(EPMM4, mask[3]);
+
+	// Same byte order as EDMACS
+	enc424j600WriteReg(EPMCS, (checksum << 8) | (checksum >> 8));
 }
 
 /********************************************************************
@@ -264,6 +529,24 @@ void enc424j600WriteMemoryWindow(uint8_t window, uint8_t *data, uint16_t length)
 		enc424j600ReadN(op, data, length);
 	}
 
+/**
+ * Switch to the bank holding a banked register, if needed. EUDAST to ECON1
+ * are mapped into every bank so never need a switch.
+ * @variable <uint16_t> address - register address
+ */
+static void enc424j600SelectBank(uint16_t address) {
+	uint8_t bank;
+
+	if ((address & 0x1F) >= (EUDAST & 0x1F))
+		return;
+
+	bank = ((uint8_t) address) & 0xE0;
+	if (bank != currentBank) {
+		enc424j600ExecuteOp0(B0SEL + (bank >> 4));
+		currentBank = bank;
+	}
+}
+
 /**
  * Reads from address
  * @variable <uint16_t> address - register address
@@ -271,23 +554,9 @@ void enc424j600WriteMemoryWindow(uint8_t window, uint8_t *data, uint16_t length)
  */
 uint16_t enc424j600ReadReg(uint16_t address) {
 	uint16_t returnValue;
-	uint8_t bank;
 
-	// See if we need to change register banks
-	bank = ((uint8_t) address) & 0xE0;
-	if (bank <= (0x3u << 5)) {
-		if (bank != currentBank) {
-			if (bank == (0x0u << 5))
-				enc424j600ExecuteOp0(B0SEL);
-			else if (bank == (0x1u << 5))
-				enc424j600ExecuteOp0(B1SEL);
-			else if (bank == (0x2u << 5))
-				enc424j600ExecuteOp0(B2SEL);
-			else if (bank == (0x3u << 5))
-				enc424j600ExecuteOp0(B3SEL);
-
-			currentBank = bank;
-		}
+	if (address < BANKED_LIMIT) {
+		enc424j600SelectBank(address);
 		returnValue = enc424j600ExecuteOp16(RCR | (address & 0x1F), 0x0000);
 	} else {
 		uint32_t returnValue32 = enc424j600ExecuteOp32(RCRU, (uint32_t) address);
@@ -304,23 +573,8 @@ uint16_t enc424j600ReadReg(uint16_t address) {
  * @variable <uint16_t> data - data to register
  */
 void enc424j600WriteReg(uint16_t address, uint16_t data) {
-	uint8_t bank;
-
-	// See if we need to change register banks
-	bank = ((uint8_t) address) & 0xE0;
-	if (bank <= (0x3u << 5)) {
-		if (bank != currentBank) {
-			if (bank == (0x0u << 5))
-				enc424j600ExecuteOp0(B0SEL);
-			else if (bank == (0x1u << 5))
-				enc424j600ExecuteOp0(B1SEL);
-			else if (bank == (0x2u << 5))
-				enc424j600ExecuteOp0(B2SEL);
-			else if (bank == (0x3u << 5))
-				enc424j600ExecuteOp0(B3SEL);
-
-			currentBank = bank;
-		}
+	if (address < BANKED_LIMIT) {
+		enc424j600SelectBank(address);
 		enc424j600ExecuteOp16(WCR | (address & 0x1F), data);
 	} else {
 		uint32_t data32;
@@ -364,82 +618,51 @@ void enc424j600WritePHYReg(uint8_t address, uint16_t Data) {
 }
 
 static void enc424j600ReadN(uint8_t op, uint8_t* data, uint16_t dataLen) {
-	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	// Take the SPI bus and assert CS
+	spi_select(&spi_dev);
 
 	// Issue read command
 	spi_rw(op);
 
 	// Fill the data buffer
-	while (dataLen--) {
-		*data++ = spi_rw(0x00);
-	}
+	spi_read_block(data, dataLen);
 
-	// Release SPI
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	// Release CS and the SPI bus
+	spi_deselect(&spi_dev);
 }
 
 static void enc424j600WriteN(uint8_t op, uint8_t* data, uint16_t dataLen) {
-	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	// Take the SPI bus and assert CS
+	spi_select(&spi_dev);
 
 	// Issue write command
 	spi_rw(op);
 
 	// Write data
-	while (dataLen--) {
-		spi_rw(*data++);
-	}
+	spi_write_block(data, dataLen);
 
-	// Release SPI
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	// Release CS and the SPI bus
+	spi_deselect(&spi_dev);
 }
 
 static void enc424j600BFSReg(uint16_t address, uint16_t bitMask) {
-	uint8_t bank;
-
-	// See if we need to change register banks
-	bank = ((uint8_t) address) & 0xE0;
-	if (bank != currentBank) {
-		if (bank == (0x0u << 5))
-			enc424j600ExecuteOp0(B0SEL);
-		else if (bank == (0x1u << 5))
-			enc424j600ExecuteOp0(B1SEL);
-		else if (bank == (0x2u << 5))
-			enc424j600ExecuteOp0(B2SEL);
-		else if (bank == (0x3u << 5))
-			enc424j600ExecuteOp0(B3SEL);
-
-		currentBank = bank;
+	if (address < BANKED_LIMIT) {
+		enc424j600SelectBank(address);
+		enc424j600ExecuteOp16(BFS | (address & 0x1F), bitMask);
+	} else {
+		enc424j600ExecuteOp32(BFSU, ((uint32_t) bitMask << 8) | (uint8_t) address);
 	}
-
-	enc424j600ExecuteOp16(BFS | (address & 0x1F), bitMask);
 }
 
 static void enc424j600BFCReg(uint16_t address, uint16_t bitMask) {
-	uint8_t bank;
-
-	// See if we need to change register banks
-	bank = ((uint8_t) address) & 0xE0;
-	if (bank != currentBank) {
-		if (bank == (0x0u << 5))
-			enc424j600ExecuteOp0(B0SEL);
-		else if (bank == (0x1u << 5))
-			enc424j600ExecuteOp0(B1SEL);
-		else if (bank == (0x2u << 5))
-			enc424j600ExecuteOp0(B2SEL);
-		else if (bank == (0x3u << 5))
-			enc424j600ExecuteOp0(B3SEL);
-
-		currentBank = bank;
+	if (address < BANKED_LIMIT) {
+		enc424j600SelectBank(address);
+		enc424j600ExecuteOp16(BFC | (address & 0x1F), bitMask);
+	} else {
+		enc424j600ExecuteOp32(BFCU, ((uint32_t) bitMask << 8) | (uint8_t) address);
 	}
-
-	enc424j600ExecuteOp16(BFC | (address & 0x1F), bitMask);
 }
+
 /********************************************************************
  * EXECUTES
  * ******************************************************************/
@@ -449,16 +672,14 @@ static void enc424j600BFCReg(uint16_t address, uint16_t bitMask) {
  * @variable <uint8_t> op - operation
  */
 static void enc424j600ExecuteOp0(uint8_t op) {
-	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	// Take the SPI bus and assert CS
+	spi_select(&spi_dev);
 
 	// Issue command
 	spi_rw(op);
 
-	// Release SPI
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	// Release CS and the SPI bus
+	spi_deselect(&spi_dev);
 }
 
 /**
@@ -469,9 +690,8 @@ static void enc424j600ExecuteOp0(uint8_t op) {
 uint8_t enc424j600ExecuteOp8(uint8_t op, uint8_t data) {
 	uint8_t returnValue;
 
-	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	// Take the SPI bus and assert CS
+	spi_select(&spi_dev);
 
 	// Issue command
 	spi_rw(op);
@@ -479,9 +699,8 @@ uint8_t enc424j600ExecuteOp8(uint8_t op, uint8_t data) {
 	// Send data byte
 	returnValue = spi_rw(data);
 
-	// release CS
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	// Release CS and the SPI bus
+	spi_deselect(&spi_dev);
 
 	return returnValue;
 }
@@ -494,21 +713,17 @@ uint8_t enc424j600ExecuteOp8(uint8_t op, uint8_t data) {
 uint16_t enc424j600ExecuteOp16(uint8_t op, uint16_t data) {
 	uint16_t returnValue;
 
-	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	// Take the SPI bus and assert CS
+	spi_select(&spi_dev);
 
 	// Issue command
 	spi_rw(op);
 
 	// Read/write data
-	for (int x = 0; x < 2; x++) {
-		((uint8_t*) & returnValue)[x] = spi_rw(((uint8_t*) & data)[x]);
-	}
+	spi_xfer_block(&data, &returnValue, 2);
 
-	// release CS
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	// Release CS and the SPI bus
+	spi_deselect(&spi_dev);
 
 	return returnValue;
 }
@@ -519,23 +734,19 @@ uint16_t enc424j600ExecuteOp16(uint8_t op, uint16_t data) {
  * @variable <uint32_t> data - data
  */
 uint32_t enc424j600ExecuteOp32(uint8_t op, uint32_t data) {
-	uint16_t returnValue;
+	uint32_t returnValue = 0;
 
-	// Start SPI
-	spi_init();
-	ENC424J600_CONTROL_PORT &= ~_BV(ENC424J600_CONTROL_CS);
+	// Take the SPI bus and assert CS
+	spi_select(&spi_dev);
 
 	// Issue command
 	spi_rw(op);
 
 	// Read/write data
-	for (int x = 0; x < 3; x++) {
-		((uint8_t*) & returnValue)[x] = spi_rw(((uint8_t*) & data)[x]);
-	}
+	spi_xfer_block(&data, &returnValue, 3);
 
-	// release CS
-	ENC424J600_CONTROL_PORT |= _BV(ENC424J600_CONTROL_CS);
-	spi_release();
+	// Release CS and the SPI bus
+	spi_deselect(&spi_dev);
 
 	return returnValue;
 }
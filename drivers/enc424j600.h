@@ -56,14 +56,37 @@
 #define ENC100_TRANSLATE_TO_PIN_ADDR(a)		((a) & 0x00FFu)
 
 // ENC424J600 config
+#ifdef CONFIG_DRIVERS_ENC424J600_TX_SLOTS
+#define ENC424J600_TX_SLOTS	CONFIG_DRIVERS_ENC424J600_TX_SLOTS
+#else
+#define ENC424J600_TX_SLOTS	1
+#endif
+#define ENC424J600_TX_SLOT_SIZE	(0x0600) // Room for a full-sized frame
 #define ENC424J600_RAMSIZE	(0x6000)
 #define ENC424J600_TXSTART	(0x0000)
-#define ENC424J600_RXSTART	(0x0600) // Should be an even memory address
+#define ENC424J600_RXSTART	(ENC424J600_TXSTART + \
+	ENC424J600_TX_SLOTS * ENC424J600_TX_SLOT_SIZE) // Should be an even memory address
 
 void enc424j600Init(void);
 uint16_t enc424j600PacketReceive(uint16_t maxlen, uint8_t* packet);
+uint8_t enc424j600PacketCount(void);
+uint16_t enc424j600PacketRead(uint16_t maxlen, uint8_t* packet);
+uint16_t enc424j600PacketCopy(uint16_t maxlen, uint8_t* packet);
+void enc424j600PacketRelease(void);
+uint16_t enc424j600RxChecksum(uint16_t offset, uint16_t len, uint16_t seed);
 void enc424j600PacketSend(uint16_t len, uint8_t* packet);
+void enc424j600TxSelect(uint8_t slot);
+void enc424j600PacketWrite(uint16_t len, uint8_t* packet);
+void enc424j600PacketPatch(uint16_t offset, uint8_t* data, uint16_t len);
+uint16_t enc424j600TxChecksum(uint16_t offset, uint16_t len, uint16_t seed);
+void enc424j600PacketTransmit(uint16_t len);
 void enc424j600GetMACAddr(uint8_t addr[6]);
+uint8_t enc424j600LinkChanged(void);
+uint16_t enc424j600RxAborts(void);
+void enc424j600SetRxFilter(uint16_t erxfcon);
+void enc424j600HashClear(void);
+void enc424j600HashAdd(const uint8_t addr[6]);
+void enc424j600SetPattern(uint16_t offset, const uint16_t mask[4], uint16_t checksum);
 uint16_t enc424j600ReadReg(uint16_t address);
 void enc424j600WriteReg(uint16_t address, uint16_t data);
 uint16_t enc424j600ReadPHYReg(uint8_t address);
@@ -471,6 +494,13 @@ typedef union __attribute__((aligned(2), packed)) {
 #define ERXFCON_MCEN            (1<<1)
 #define ERXFCON_BCEN            (1)
 
+// ERXFCON PMEN<3:0> pattern match modes ---------
+#define ERXFCON_PM_ANY		(ERXFCON_PMEN0)
+#define ERXFCON_PM_UNICAST	(ERXFCON_PMEN1)
+#define ERXFCON_PM_MULTICAST	(ERXFCON_PMEN2)
+#define ERXFCON_PM_BROADCAST	(ERXFCON_PMEN2 | ERXFCON_PMEN1)
+#define ERXFCON_PM_HASH		(ERXFCON_PMEN3)
+
 // MACON1 bits ---------
 #define MACON1_r15		((uint16_t)1<<15)
 #define MACON1_r14		((uint16_t)1<<14)
@@ -19,10 +19,14 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <avr/io.h>
 
 #include "spi.h"
 
+// Device whose settings are loaded into SPCR/SPSR
+static const spi_device_t *active;
+
 void spi_init(void) {
 	// Set up initial output values / pull-ups
 	CONFIG_DRIVERS_SPI_PORT |=
@@ -43,11 +47,15 @@ void spi_init(void) {
 	// Initialize the SPI system
 	SPCR = _BV(SPE) | _BV(MSTR);
 	SPSR = _BV(SPI2X);
+
+	// No device settings are loaded
+	active = NULL;
 }
 
 void spi_release(void) {
 	// Disable the SPI system
 	SPCR = 0;
+	active = NULL;
 
 	// Release pins
 	CONFIG_DRIVERS_SPI_DDR  &= ~(
@@ -59,3 +67,111 @@ void spi_release(void) {
 		_BV(CONFIG_DRIVERS_SPI_SS));
 }
 
+
+void spi_select(const spi_device_t *dev) {
+	// Set the bus up again if someone has turned it off
+	if (!(SPCR & _BV(SPE))) {
+		spi_init();
+	}
+
+	// Load the device's mode and clock if they aren't already
+	if (active != dev) {
+		SPCR = dev->spcr;
+		SPSR = dev->spsr;
+		active = dev;
+	}
+
+	*dev->cs_port &= ~dev->cs_mask;
+}
+
+void spi_deselect(const spi_device_t *dev) {
+	*dev->cs_port |= dev->cs_mask;
+}
+
+void spi_read_block(void *buf, uint16_t len) {
+	uint8_t *cbuf = buf;
+	uint8_t in;
+
+	if (!len) {
+		return;
+	}
+
+	// Start the first transfer
+	SPDR = 0x00;
+
+	// Leave the last byte for after the loop
+	len--;
+
+	// Each byte is stored while the next one is being clocked in. Two
+	// bytes are handled per iteration to cut the loop overhead.
+	if (len & 1) {
+		while (!(SPSR & _BV(SPIF))) { ; }
+		in = SPDR;
+		SPDR = 0x00;
+		*cbuf++ = in;
+	}
+
+	for (len >>= 1; len; len--) {
+		while (!(SPSR & _BV(SPIF))) { ; }
+		in = SPDR;
+		SPDR = 0x00;
+		*cbuf++ = in;
+
+		while (!(SPSR & _BV(SPIF))) { ; }
+		in = SPDR;
+		SPDR = 0x00;
+		*cbuf++ = in;
+	}
+
+	// Collect the final byte
+	while (!(SPSR & _BV(SPIF))) { ; }
+	*cbuf = SPDR;
+}
+
+void spi_write_block(const void *buf, uint16_t len) {
+	const uint8_t *cbuf = buf;
+	uint8_t out;
+
+	if (!len) {
+		return;
+	}
+
+	// Start the first transfer
+	SPDR = *cbuf++;
+
+	// Fetch each byte before waiting so SPDR is reloaded straight away
+	while (--len) {
+		out = *cbuf++;
+		while (!(SPSR & _BV(SPIF))) { ; }
+		SPDR = out;
+	}
+
+	// Wait for the final byte and clear SPIF
+	while (!(SPSR & _BV(SPIF))) { ; }
+	(void)SPDR;
+}
+
+void spi_xfer_block(const void *out, void *in, uint16_t len) {
+	const uint8_t *cout = out;
+	uint8_t *cin = in;
+	uint8_t next, byte;
+
+	if (!len) {
+		return;
+	}
+
+	// Start the first transfer
+	SPDR = *cout++;
+
+	while (--len) {
+		next = *cout++;
+		while (!(SPSR & _BV(SPIF))) { ; }
+		byte = SPDR;
+		SPDR = next;
+		*cin++ = byte;
+	}
+
+	// Collect the final byte
+	while (!(SPSR & _BV(SPIF))) { ; }
+	*cin = SPDR;
+}
@@ -23,10 +23,52 @@
 
 #include <stdint.h>
 
+// SPI modes (clock polarity and phase)
+#define SPI_MODE_0	0
+#define SPI_MODE_1	_BV(CPHA)
+#define SPI_MODE_2	_BV(CPOL)
+#define SPI_MODE_3	(_BV(CPOL) | _BV(CPHA))
+
+// Clock dividers: bits 0-1 are SPR1:0 and bit 2 is SPI2X
+#define SPI_CLOCK_DIV2		0x04
+#define SPI_CLOCK_DIV4		0x00
+#define SPI_CLOCK_DIV8		0x05
+#define SPI_CLOCK_DIV16		0x01
+#define SPI_CLOCK_DIV32		0x06
+#define SPI_CLOCK_DIV64		0x02
+#define SPI_CLOCK_DIV128	0x03
+
+// A device on the SPI bus. Use SPI_DEVICE() to fill one in.
+typedef struct {
+	volatile uint8_t *cs_port;
+	uint8_t cs_mask;
+	uint8_t spcr;
+	uint8_t spsr;
+} spi_device_t;
+
+#define SPI_DEVICE(port, cs, mode, div) { \
+	.cs_port = &(port), \
+	.cs_mask = _BV(cs), \
+	.spcr = _BV(SPE) | _BV(MSTR) | (mode) | ((div) & 0x03), \
+	.spsr = ((div) >> 2) << SPI2X, \
+}
+
 void spi_init(void);
 void spi_release(void);
+
+// Assert the device's CS. The SPI registers are only written if a
+// different device used the bus last. Nothing touches SPI from interrupt
+// context, so transactions can't overlap and there is no locking.
+void spi_select(const spi_device_t *dev);
+void spi_deselect(const spi_device_t *dev);
+
 inline uint8_t spi_rw(uint8_t out);
 
+// Bulk transfers, with the next byte queued as soon as SPIF is set
+void spi_read_block(void *buf, uint16_t len);
+void spi_write_block(const void *buf, uint16_t len);
+void spi_xfer_block(const void *out, void *in, uint16_t len);
+
 inline uint8_t spi_rw(uint8_t out) {
 	uint8_t in;
 
@@ -145,6 +145,7 @@ struct polyfs_super {
 #define POLYFS_FLAG_SHIFTED_ROOT_OFFSET	0x00000008	/* shifted root fs */
 #define POLYFS_FLAG_ZLIB_COMPRESSION	0x00000010	/* zlib compression */
 #define POLYFS_FLAG_LZO_COMPRESSION		0x00000020	/* LZO compression */
+#define POLYFS_FLAG_LZO_IMAGE			0x00000040	/* LZO compressed image */
 
 /*
  * Valid values in super.flags.  Currently we refuse to mount
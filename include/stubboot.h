@@ -78,15 +78,45 @@ struct stubboot_table {
 	 *  >0 - on success after write retries (return is number of retries)
 	 */
 	int8_t (* update_loader)(uint8_t pages, uint16_t crc, void *addr);
+
+	/*
+	 * The following are only present if ver_minor >= 1.
+	 */
+
+	/*
+	 * Erases a flash page and starts writing it, like write_page, but returns
+	 * while the write is still in progress. Nothing in the application
+	 * section can be read until write_page_finish is called, and the buffer
+	 * must be left alone until then.
+	 *
+	 * Returns:
+	 *  -1 - on failure
+	 *   0 - on success
+	 */
+	int8_t (* write_page_start)(uint16_t page, const void *addr);
+
+	/*
+	 * Waits for a write started with write_page_start to complete and
+	 * verifies it, retrying as write_page does if the data doesn't match.
+	 * 'page' and 'addr' must be the same as were passed to write_page_start.
+	 *
+	 * Returns:
+	 *  -1 - on failure
+	 *   0 - on success
+	 *  >0 - on success after write retries (return is number of retries)
+	 */
+	int8_t (* write_page_finish)(uint16_t page, const void *addr);
 };
 
 // Compile-time check of struct size
-verify(sizeof(struct stubboot_table) == 8);
+verify(sizeof(struct stubboot_table) == 12);
 
 // Function to retrieve stubboot_table without memcpy_PF
 void stubboot_read_table(struct stubboot_table *t);
 
 int stubboot_write_page(uint16_t page, const void *addr);
+int stubboot_write_page_start(uint16_t page, const void *addr);
+int stubboot_write_page_finish(uint16_t page, const void *addr);
 int stubboot_update_loader(uint8_t pages, uint16_t crc, void *addr);
 
 #endif // STUBBOOT_H
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include "chksum.h"
+
+uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len) {
+	const uint8_t *end = data + (len & ~1);
+	uint16_t t;
+
+	while (data < end) {
+		t = (data[0] << 8) + data[1];
+		sum += t;
+		if (sum < t) {
+			sum++;
+		}
+		data += 2;
+	}
+
+	// Odd byte at the end
+	if (len & 1) {
+		t = data[0] << 8;
+		sum += t;
+		if (sum < t) {
+			sum++;
+		}
+	}
+
+	return sum;
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef CHKSUM_H
+#define CHKSUM_H
+
+#include <stdint.h>
+
+/*
+ * Add len bytes of data to a 16-bit one's complement sum, as used by the
+ * IP, TCP and UDP checksums. The data is summed as big-endian words, an odd
+ * last byte being padded with zero, and the sum is in host byte order.
+ */
+uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len);
+
+#endif // CHKSUM_H
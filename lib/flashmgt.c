@@ -18,6 +18,7 @@
  * MA 02110-1301, USA.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <polyfs.h>
 #include <polyfs_df.h>
@@ -35,6 +36,9 @@
 
 #if CONFIG_IMAGE_BOOTLOADER
 #include <stubboot.h>
+#else
+#include <stdlib.h>
+#include <contiki.h>
 #endif
 
 #include "drivers/dataflash.h"
@@ -54,15 +58,103 @@ struct flashmgt_status {
 // Compile-time check of struct size
 verify(sizeof(struct flashmgt_status) == 4);
 
+#if !CONFIG_IMAGE_BOOTLOADER
+// How far a write has got, so an interrupted download can carry on
+struct flashmgt_resume {
+	uint32_t id; // identifies the image, 0 if there's nothing to resume
+	uint32_t done; // partition offset everything before is in flash
+	uint32_t crc; // streaming CRC up to done
+	uint32_t crc_size; // image size from the superblock
+	uint32_t crc_read; // CRC stored in the superblock
+	uint8_t part; // partition being written
+	uint8_t padding[3];
+};
+
+// Compile-time check of struct size
+verify(sizeof(struct flashmgt_resume) == 24);
+#endif
+
+#ifdef CONFIG_FLASHMGT_P1_START
 static struct flashmgt_partition part[] = {
 	{ .start = CONFIG_FLASHMGT_P1_START, .end = CONFIG_FLASHMGT_P1_END },
 	{ .start = CONFIG_FLASHMGT_P2_START, .end = CONFIG_FLASHMGT_P2_END },
 };
+#else
+// Split the flash into two halves once its size is known
+static struct flashmgt_partition part[2];
+#endif
 
 #if !CONFIG_IMAGE_BOOTLOADER
+// Number of page buffers; one can fill while another is programmed
+#define WRITE_PAGES 2
+
+// How often to check whether an erase has finished
+#define ERASE_POLL_INTERVAL (CLOCK_SECOND / 20)
+
+// How much flash is checked for blankness before yielding
+#define BLANK_CHECK_SIZE 1024
+
+// How far ahead of the last write to erase while idle
+#define ERASE_AHEAD DATAFLASH_SECTOR_4K_SIZE
+
+// How often the write progress is saved; a multiple of the erase size
+#define RESUME_INTERVAL (4 * DATAFLASH_SECTOR_4K_SIZE)
+
+// Superblock fields picked out by the streaming CRC
+#define SUPER_SIZE_OFFSET offsetof(struct polyfs_super, size)
+#define SUPER_CRC_OFFSET \
+	(offsetof(struct polyfs_super, fsid) + offsetof(struct polyfs_info, crc))
+#define SUPER_FIELDS_END (SUPER_CRC_OFFSET + sizeof(uint32_t))
+
+// Return values from step()
+#define STEP_IDLE 0
+#define STEP_MORE 1
+#define STEP_BUSY 2
+
 static struct {
 	uint8_t sec_write_ready : 1;
+	uint8_t erasing : 1;
+	uint8_t flash_busy : 1;
+	uint8_t filling : 1; // newest page buffer can take more data
+	uint8_t crc_valid : 1; // data has arrived in order so far
+	uint8_t resumable : 1; // progress is being saved
 } flags;
+
+// A page of data waiting to be programmed
+struct write_page {
+	uint32_t addr; // flash address of the page
+	uint16_t lo; // first byte that has been written
+	uint16_t hi; // one past the last byte that has been written
+	uint8_t data[DATAFLASH_WR_PAGE_SIZE];
+};
+
+// State shared between the API calls and flashmgt_process
+static struct {
+	struct process *caller; // gets flashmgt_event when the erase is done
+	uint32_t erased; // the partition is erased from its start up to here
+	uint32_t target; // erase at least up to here
+	uint32_t end; // one past the last byte of data written
+	uint32_t check; // next address to check for blankness
+	uint32_t inflight; // size of the erase in progress
+	struct write_page *pages; // ring of page buffers
+	uint8_t head; // oldest page buffer
+	uint8_t count; // page buffers in use
+	int error; // first error from a queued write
+	uint32_t crc; // CRC of the image data seen so far
+	uint32_t crc_pos; // partition offset the next data should be at
+	uint32_t crc_size; // image size from the superblock
+	uint32_t crc_read; // CRC stored in the superblock
+	uint32_t id; // resume id passed to flashmgt_sec_write_resume()
+	uint32_t save_at; // progress to save once programmed, 0 if none
+	uint32_t save_crc; // streaming CRC at save_at
+} wr;
+
+static struct flashmgt_write_stats stats;
+
+PROCESS(flashmgt_process, "flashmgt");
+INIT_PROCESS(flashmgt_process);
+
+process_event_t flashmgt_event;
 #endif
 
 static struct flashmgt_status status;
@@ -75,6 +167,7 @@ static int flashmgt_init(void);
 INIT_LIBRARY(flashmgt, flashmgt_init);
 
 static int flashmgt_init(void) {
+	const dataflash_geometry_t *geom = dataflash_geometry();
 	int ret;
 
 #if CONFIG_LIB_POLYFS_CFS
@@ -83,6 +176,23 @@ static int flashmgt_init(void) {
 	polyfs_cfs_fs = NULL;
 #endif
 
+	// Make sure the flash chip was found
+	if (!geom) {
+		return -1;
+	}
+
+#ifndef CONFIG_FLASHMGT_P1_START
+	part[0].start = 0;
+	part[0].end = geom->size / 2 - 1;
+	part[1].start = geom->size / 2;
+	part[1].end = geom->size - 1;
+#endif
+
+	// Make sure the partitions fit in the part
+	if (part[0].end >= geom->size || part[1].end >= geom->size) {
+		return -1;
+	}
+
 	// Make sure the flash chip is ready
 	ret = dataflash_wait_ready();
 	if (ret) {
@@ -172,50 +282,231 @@ int flashmgt_sec_close(polyfs_fs_t *ptr) {
 }
 
 #if !CONFIG_IMAGE_BOOTLOADER
-int flashmgt_sec_write_start(void) {
+// Set SPRL and lock all sectors
+static void relock(void) {
+	dataflash_write_enable();
+	dataflash_write_status(0x3c);
+	dataflash_write_enable();
+	dataflash_write_status(DATAFLASH_SREG_SPRL | 0x3c);
+}
+
+// Smallest block the part can erase; partitions are aligned to 64K
+static uint32_t min_erase_size(void) {
+	uint8_t sizes = dataflash_geometry()->erase_sizes;
+
+	if (sizes & DATAFLASH_ERASE_4K) {
+		return DATAFLASH_SECTOR_4K_SIZE;
+	}
+	else if (sizes & DATAFLASH_ERASE_32K) {
+		return DATAFLASH_SECTOR_32K_SIZE;
+	}
+
+	return DATAFLASH_SECTOR_64K_SIZE;
+}
+
+// Pick the largest erase block that starts at addr and ends before limit
+static uint32_t erase_size(uint32_t addr, uint32_t limit) {
+	uint8_t sizes = dataflash_geometry()->erase_sizes;
+
+	if ((sizes & DATAFLASH_ERASE_64K) &&
+		!(addr & ~DATAFLASH_SECTOR_64K_MASK) &&
+		addr + DATAFLASH_SECTOR_64K_SIZE <= limit)
+	{
+		return DATAFLASH_SECTOR_64K_SIZE;
+	}
+	else if ((sizes & DATAFLASH_ERASE_32K) &&
+		!(addr & ~DATAFLASH_SECTOR_32K_MASK) &&
+		addr + DATAFLASH_SECTOR_32K_SIZE <= limit)
+	{
+		return DATAFLASH_SECTOR_32K_SIZE;
+	}
+
+	return min_erase_size();
+}
+
+// Check the next chunk of the block at wr.erased, and start erasing the
+// block if it isn't blank. Blocks that are already blank are skipped.
+static int erase_next(uint32_t limit) {
+	uint32_t size = erase_size(wr.erased, limit);
 	int ret;
-	int sec = !status.primary;
-	uint32_t addr;
 
-	if (flags.sec_write_ready) {
-		return -1;
+	if (wr.check < wr.erased) {
+		wr.check = wr.erased;
 	}
 
-	// Allow us to change SREG
+	// Is the block already blank?
+	ret = dataflash_check_blank(wr.check, BLANK_CHECK_SIZE);
+	if (ret < 0) {
+		return ret;
+	}
+	else if (ret) {
+		wr.check += BLANK_CHECK_SIZE;
+		if (wr.check >= wr.erased + size) {
+			wr.erased += size;
+			stats.skipped++;
+		}
+		return 0;
+	}
+
+	// Let us erase sectors
 	ret = dataflash_write_enable();
 	if (ret) {
 		return ret;
 	}
 
-	// Clear SPRL, but keep sectors locked
-	ret = dataflash_write_status(0x3c);
+	if (size == DATAFLASH_SECTOR_64K_SIZE) {
+		ret = dataflash_erase_64k(wr.erased);
+	}
+	else if (size == DATAFLASH_SECTOR_32K_SIZE) {
+		ret = dataflash_erase_32k(wr.erased);
+	}
+	else {
+		ret = dataflash_erase_4k(wr.erased);
+	}
 	if (ret) {
+		return -1;
+	}
+
+	wr.inflight = size;
+	flags.flash_busy = 1;
+	stats.erased++;
+
+	return 0;
+}
+
+static inline struct write_page *page_at(uint8_t idx) {
+	return &wr.pages[(wr.head + idx) % WRITE_PAGES];
+}
+
+// Start programming the oldest page buffer and free it up
+static int write_next(void) {
+	struct write_page *page = page_at(0);
+	int ret;
+
+	// Enable writes
+	ret = dataflash_write_enable();
+	if (ret < 0) {
 		return ret;
 	}
 
-	// Unprotect the sectors
-	addr = part[sec].start;
-	while (addr <= part[sec].end) {
-		dataflash_sector_t sec;
+	// Program everything that was written to the page in one go
+	ret = dataflash_write_data(page->data + page->lo, page->addr + page->lo,
+		page->hi - page->lo);
+	if (ret < 0) {
+		return ret;
+	}
 
-		if (dataflash_sector_from_addr(addr, &sec)) {
-			break;
-		}
+	// The data is in the flash's own buffer now
+	wr.head = (wr.head + 1) % WRITE_PAGES;
+	wr.count--;
+	flags.flash_busy = 1;
+	stats.programmed++;
 
-		ret = dataflash_write_enable();
-		if (ret) {
+	return 0;
+}
+
+// Record how far the write has got
+static int resume_save(uint32_t id, uint32_t done, uint32_t crc) {
+	struct flashmgt_resume rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.id = id;
+	rec.done = done;
+	rec.crc = crc;
+	rec.crc_size = wr.crc_size;
+	rec.crc_read = wr.crc_read;
+	rec.part = !status.primary;
+
+	if (settings_set(SETTINGS_KEY_FLASHMGT_RESUME, &rec, sizeof(rec)) !=
+		SETTINGS_STATUS_OK)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+// Do the next bit of erasing or programming, if the flash is free. Queued
+// data is written as soon as the area it goes to has been erased; when
+// there is nothing to write, the partition is erased up to wr.target.
+static int step(void) {
+	uint32_t limit;
+	int ret;
+
+	// Wait for the last operation to finish
+	if (flags.flash_busy) {
+		ret = dataflash_busy();
+		if (ret < 0) {
 			return ret;
 		}
+		else if (ret) {
+			return STEP_BUSY;
+		}
 
-		ret = dataflash_unprotect_sector(addr);
-		if (ret) {
-			// Re-lock everything
-			dataflash_write_enable();
-			dataflash_write_status(DATAFLASH_SREG_SPRL | 0x3c);
-			return ret;
+		flags.flash_busy = 0;
+		wr.erased += wr.inflight;
+		wr.inflight = 0;
+	}
+
+	// Save the progress once everything before it has been programmed
+	if (wr.save_at && (!wr.count ||
+		page_at(0)->addr >= part[!status.primary].start + wr.save_at))
+	{
+		if (flags.resumable && resume_save(wr.id, wr.save_at, wr.save_crc)) {
+			flags.resumable = 0;
+		}
+		wr.save_at = 0;
+	}
+
+	// Erase up to the end of the buffered data, or the target if further
+	limit = wr.target;
+	for (uint8_t i = 0; i < wr.count; i++) {
+		struct write_page *page = page_at(i);
+
+		if (limit < page->addr + page->hi) {
+			limit = page->addr + page->hi;
 		}
+	}
+	limit = (limit + DATAFLASH_SECTOR_4K_SIZE - 1) & DATAFLASH_SECTOR_4K_MASK;
+	if (limit > part[!status.primary].end + 1) {
+		limit = part[!status.primary].end + 1;
+	}
+
+	// Program the oldest page once it's complete and erased
+	if (wr.count && !(wr.count == 1 && flags.filling) &&
+		page_at(0)->addr + page_at(0)->hi <= wr.erased)
+	{
+		ret = write_next();
+	}
+	else if (wr.erased < limit) {
+		ret = erase_next(limit);
+	}
+	else {
+		return STEP_IDLE;
+	}
+
+	return ret < 0 ? ret : STEP_MORE;
+}
+
+// Program page buffers without yielding until no more than keep are in
+// use. With keep == 0, everything is flushed out to the flash.
+static int write_drain(uint8_t keep) {
+	int ret;
+
+	// The newest page has to go too if it's in the way
+	if (wr.count > keep) {
+		flags.filling = 0;
+	}
 
-		addr = sec.end + 1;
+	while ((wr.count > keep || (!keep && flags.flash_busy)) && !wr.error) {
+		ret = step();
+		if (ret < 0) {
+			wr.error = ret;
+		}
+		else if (ret == STEP_IDLE && wr.count > keep) {
+			// The pages can't be programmed, so don't wait for them forever
+			wr.error = -1;
+		}
 
 #if CONFIG_WATCHDOG
 		// Poke the watchdog
@@ -223,6 +514,161 @@ int flashmgt_sec_write_start(void) {
 #endif
 	}
 
+	return wr.error;
+}
+
+PROCESS_THREAD(flashmgt_process, ev, data) {
+	static struct etimer et;
+	int ret;
+
+	PROCESS_BEGIN();
+
+	flashmgt_event = process_alloc_event();
+
+	while (1) {
+		PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+
+		while ((flags.erasing || flags.sec_write_ready) && !wr.error) {
+			ret = step();
+
+			if (ret < 0) {
+				wr.error = ret;
+			}
+			else if (ret == STEP_IDLE) {
+				break;
+			}
+			else if (ret == STEP_BUSY && wr.inflight) {
+				// Let everything else run while the erase completes
+				etimer_set(&et, ERASE_POLL_INTERVAL);
+				PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+			}
+			else {
+				PROCESS_PAUSE();
+			}
+		}
+
+		// Tell the caller when the partition is ready to take data
+		if (flags.erasing) {
+			flags.erasing = 0;
+			if (wr.error) {
+				relock();
+			}
+			else {
+				flags.sec_write_ready = 1;
+			}
+			process_post(wr.caller, flashmgt_event, (void *)(intptr_t)wr.error);
+		}
+	}
+
+	PROCESS_END();
+}
+
+// Unprotect one sector; for use with dataflash_sector_range()
+static int unprotect_sector(const dataflash_sector_t *sector, void *arg) {
+	int ret;
+
+	ret = dataflash_write_enable();
+	if (ret) {
+		return ret;
+	}
+
+	ret = dataflash_unprotect_sector(sector->start);
+	if (ret) {
+		// Re-lock everything
+		dataflash_write_enable();
+		dataflash_write_status(DATAFLASH_SREG_SPRL | 0x3c);
+		return ret;
+	}
+
+#if CONFIG_WATCHDOG
+	// Poke the watchdog
+	wdt_reset();
+#endif
+
+	return 0;
+}
+
+int flashmgt_sec_write_start(uint32_t size) {
+	uint32_t offset;
+
+	return flashmgt_sec_write_resume(0, size, &offset);
+}
+
+int flashmgt_sec_write_resume(uint32_t id, uint32_t size, uint32_t *offset) {
+	int ret;
+	int sec = !status.primary;
+	struct flashmgt_resume rec;
+	size_t recsize = sizeof(rec);
+
+	if (flags.sec_write_ready || flags.erasing) {
+		return -1;
+	}
+
+	// The image has to fit in the partition
+	if (size > part[sec].end - part[sec].start + 1) {
+		return -1;
+	}
+
+	// See if there's an earlier attempt to carry on from
+	if (settings_get(SETTINGS_KEY_FLASHMGT_RESUME, 0, &rec, &recsize) !=
+		SETTINGS_STATUS_OK || recsize != sizeof(rec))
+	{
+		memset(&rec, 0, sizeof(rec));
+	}
+	if (!id || rec.id != id || rec.part != sec ||
+		rec.done > part[sec].end - part[sec].start + 1 ||
+		(rec.done % min_erase_size()))
+	{
+		// Whatever it described is about to be overwritten
+		if (rec.id && resume_save(0, 0, 0)) {
+			return -1;
+		}
+		memset(&rec, 0, sizeof(rec));
+	}
+
+	// Allocate the page buffers
+	if (!wr.pages) {
+		wr.pages = malloc(WRITE_PAGES * sizeof(*wr.pages));
+		if (!wr.pages) {
+			return -1;
+		}
+	}
+	wr.head = wr.count = 0;
+	flags.filling = 0;
+	wr.error = 0;
+
+	// Start the streaming CRC where the last attempt left it
+	wr.crc = rec.crc;
+	wr.crc_pos = rec.done;
+	wr.crc_size = rec.crc_size;
+	wr.crc_read = rec.crc_read;
+	flags.crc_valid = 1;
+
+	// Keep track of the progress if it might be resumed
+	wr.id = id;
+	wr.save_at = 0;
+	flags.resumable = !!id;
+	memset(&stats, 0, sizeof(stats));
+
+	// Allow us to change SREG
+	ret = dataflash_write_enable();
+	if (ret) {
+		return ret;
+	}
+
+	// Clear SPRL, but keep sectors locked
+	ret = dataflash_write_status(0x3c);
+	if (ret) {
+		return ret;
+	}
+
+	// Unprotect the sectors
+	ret = dataflash_sector_range(part[sec].start, part[sec].end,
+		unprotect_sector, NULL);
+	if (ret) {
+		return ret;
+	}
+
 	// Allow us to change SREG
 	ret = dataflash_write_enable();
 	if (ret) {
@@ -235,107 +681,248 @@ int flashmgt_sec_write_start(void) {
 		return ret;
 	}
 
-	// Now erase the partition
-	addr = part[sec].start;
-	while (addr <= part[sec].end) {
-		// Let us erase sectors
-		ret = dataflash_write_enable();
-		if (ret) {
-			return ret;
+	// Hand the erase over to flashmgt_process. Only the area the image
+	// will occupy is erased up front; the rest is done as data arrives.
+	wr.caller = PROCESS_CURRENT();
+	wr.erased = wr.check = part[sec].start + rec.done;
+	wr.target = part[sec].start + (size > rec.done ? size : rec.done);
+	wr.end = part[sec].start + rec.done;
+	wr.inflight = 0;
+	flags.flash_busy = 0;
+	flags.erasing = 1;
+	process_poll(&flashmgt_process);
+
+	*offset = rec.done;
+	return 0;
+}
+
+// Run the polyfs CRC over image data as it is written, with the CRC
+// field in the superblock taken as zero. Gives up if the data doesn't
+// arrive in order; finish then reads the image back instead.
+static void crc_update(const uint8_t *buf, uint32_t offset, uint32_t len) {
+	if (!flags.crc_valid) {
+		return;
+	}
+	else if (offset != wr.crc_pos) {
+		// The progress can't be tracked either
+		flags.crc_valid = 0;
+		flags.resumable = 0;
+		wr.save_at = 0;
+		return;
+	}
+
+	wr.crc_pos += len;
+
+	// Pick the size and CRC out of the superblock as they go past
+	for (; len && offset < SUPER_FIELDS_END; offset++, len--) {
+		uint8_t byte = *buf++;
+
+		if (offset >= SUPER_SIZE_OFFSET &&
+			offset < SUPER_SIZE_OFFSET + sizeof(uint32_t))
+		{
+			((uint8_t *)&wr.crc_size)[offset - SUPER_SIZE_OFFSET] = byte;
+		}
+		else if (offset >= SUPER_CRC_OFFSET) {
+			((uint8_t *)&wr.crc_read)[offset - SUPER_CRC_OFFSET] = byte;
+			byte = 0;
 		}
 
-		if (addr + DATAFLASH_SECTOR_64K_SIZE - 1 <= part[sec].end) {
-			// Erase a 64K sector
-			ret = dataflash_erase_64k(addr);
-			if (ret) {
-				return -1;
-			}
-			addr += DATAFLASH_SECTOR_64K_SIZE;
+		wr.crc = polyfs_crc32(wr.crc, &byte, 1);
+	}
+
+	while (len) {
+		uint32_t bytes = RESUME_INTERVAL - (offset % RESUME_INTERVAL);
+		uint32_t crc_bytes;
+
+		if (bytes > len) {
+			bytes = len;
 		}
-		else if (addr + DATAFLASH_SECTOR_32K_SIZE - 1 <= part[sec].end) {
-			// Erase a 32K sector
-			if (dataflash_erase_32k(addr)) {
-				return -1;
-			}
-			addr += DATAFLASH_SECTOR_32K_SIZE;
+
+		// Anything past the end of the filesystem isn't covered
+		crc_bytes = bytes;
+		if (offset >= POLYFS_32(wr.crc_size)) {
+			crc_bytes = 0;
 		}
-		else {
-			// Erase a 4K sector
-			if (dataflash_erase_4k(addr)) {
-				return -1;
-			}
-			addr += DATAFLASH_SECTOR_4K_SIZE;
+		else if (offset + bytes > POLYFS_32(wr.crc_size)) {
+			crc_bytes = POLYFS_32(wr.crc_size) - offset;
 		}
 
-		// Wait for the erase to complete
-		dataflash_wait_ready();
+		wr.crc = polyfs_crc32(wr.crc, buf, crc_bytes);
 
-#if CONFIG_WATCHDOG
-		// Poke the watchdog
-		wdt_reset();
-#endif
+		offset += bytes;
+		buf += bytes;
+		len -= bytes;
+
+		// Save the progress here once it has been programmed
+		if (!(offset % RESUME_INTERVAL)) {
+			wr.save_at = offset;
+			wr.save_crc = wr.crc;
+		}
+	}
+}
+
+int flashmgt_sec_write_check(const void *buf, uint32_t offset, uint32_t len) {
+	const uint8_t *cbuf = buf;
+	uint8_t diff = 0;
+
+	if (!flags.sec_write_ready) {
+		return -1;
+	}
+
+	// Compare the superblock size and CRC with the ones from last time
+	for (; len && offset < SUPER_FIELDS_END; offset++, len--) {
+		uint8_t byte = *cbuf++;
+
+		if (offset >= SUPER_SIZE_OFFSET &&
+			offset < SUPER_SIZE_OFFSET + sizeof(uint32_t))
+		{
+			diff |= byte ^
+				((uint8_t *)&wr.crc_size)[offset - SUPER_SIZE_OFFSET];
+		}
+		else if (offset >= SUPER_CRC_OFFSET) {
+			diff |= byte ^
+				((uint8_t *)&wr.crc_read)[offset - SUPER_CRC_OFFSET];
+		}
 	}
 
-	// OK to carry on with writes
-	flags.sec_write_ready = 1;
+	if (diff) {
+		// It's a different image, so what's in the flash is no use
+		flags.resumable = 0;
+		wr.save_at = 0;
+		if (wr.id) {
+			resume_save(0, 0, 0);
+			wr.id = 0;
+		}
+		return -1;
+	}
 
 	return 0;
 }
 
 int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len) {
 	int sec = !status.primary;
+	const void *crc_buf = buf;
+	uint32_t crc_offset = offset;
+	uint32_t crc_len = len;
 	int ret;
 
 	if (!flags.sec_write_ready) {
 		return -1;
 	}
 
+	// Don't write past the end of the partition
+	if (offset > part[sec].end - part[sec].start + 1 ||
+		len > part[sec].end - part[sec].start + 1 - offset)
+	{
+		return -1;
+	}
+
 	// The flash address is the start address of the partition + offset
 	offset += part[sec].start;
 
+	if (wr.error) {
+		return wr.error;
+	}
+
 	while (len) {
-		// Enable writes
-		ret = dataflash_write_enable();
-		if (ret < 0) {
-			return ret;
-		}
+		uint32_t addr = offset & DATAFLASH_WR_PAGE_MASK;
+		uint16_t start = offset - addr;
+		uint16_t bytes = DATAFLASH_WR_PAGE_SIZE - start;
+		struct write_page *page = NULL;
 
-		// Write the data block
-		int ret = dataflash_write_data(buf, offset,
-			len < DATAFLASH_WR_PAGE_SIZE ? len : DATAFLASH_WR_PAGE_SIZE);
+		if (bytes > len) {
+			bytes = len;
+		}
 
-		if (ret < 0) {
-			return ret;
+		// Add to the page we're filling if the data belongs there
+		if (flags.filling && page_at(wr.count - 1)->addr == addr) {
+			page = page_at(wr.count - 1);
 		}
 		else {
-			// Advance the buffer pointer
-			offset += ret;
-			buf = (uint8_t *)buf + ret;
-			len -= ret;
+			// Hand the previous page over for programming
+			flags.filling = 0;
+
+			// Make sure there's a free page buffer
+			ret = write_drain(WRITE_PAGES - 1);
+			if (ret < 0) {
+				return ret;
+			}
+
+			// Start a new page; 0xff bytes leave the flash untouched
+			page = page_at(wr.count++);
+			page->addr = addr;
+			page->lo = page->hi = start;
+			memset(page->data, 0xff, sizeof(page->data));
+			flags.filling = 1;
+		}
+
+		// Merge the data into the page
+		memcpy(page->data + start, buf, bytes);
+		if (start < page->lo) {
+			page->lo = start;
+		}
+		if (start + bytes > page->hi) {
+			page->hi = start + bytes;
 		}
 
-		// Wait for the write to complete
-		dataflash_wait_ready();
+		// A full page can be programmed straight away
+		if (page->lo == 0 && page->hi == DATAFLASH_WR_PAGE_SIZE) {
+			flags.filling = 0;
+		}
 
-#if CONFIG_WATCHDOG
-		// Poke the watchdog
-		wdt_reset();
-#endif
+		// Advance the buffer pointer
+		offset += bytes;
+		buf = (uint8_t *)buf + bytes;
+		len -= bytes;
+	}
+
+	// Only once the data is queued, so progress isn't saved too early
+	crc_update(crc_buf, crc_offset, crc_len);
+
+	if (wr.end < offset) {
+		wr.end = offset;
+	}
+
+	// Get the next bit of flash ready while waiting for more data. At a
+	// 64K boundary, go on to the next one so a single 64K erase is used.
+	uint32_t ahead = offset + ERASE_AHEAD;
+	if (ahead > wr.erased && !(wr.erased & ~DATAFLASH_SECTOR_64K_MASK)) {
+		ahead = wr.erased + DATAFLASH_SECTOR_64K_SIZE;
+	}
+	if (wr.target < ahead) {
+		wr.target = ahead;
 	}
 
+	// Let flashmgt_process program the pages
+	process_poll(&flashmgt_process);
+
 	return 0;
 }
 
+void flashmgt_sec_write_stats(struct flashmgt_write_stats *ptr) {
+	*ptr = stats;
+}
+
 int flashmgt_sec_write_abort(void) {
 	int ret;
 
 	// Check if a write was initiated
-	if (!flags.sec_write_ready) {
+	if (!flags.sec_write_ready && !flags.erasing) {
 		return 0; // nothing to do
 	}
 
-	// Switch off enable flag
+	// Switch off enable flag and stop erasing
 	flags.sec_write_ready = 0;
+	flags.erasing = 0;
+
+	// Drop any buffered data and let the last operation finish
+	wr.count = 0;
+	flags.filling = 0;
+	free(wr.pages);
+	wr.pages = NULL;
+	dataflash_wait_ready();
+	flags.flash_busy = 0;
+	wr.inflight = 0;
 
 	// Let us change SREG
 	ret = dataflash_write_enable();
@@ -383,6 +970,17 @@ int flashmgt_sec_write_finish(void) {
 		return 0; // nothing to do
 	}
 
+	// Flush out whatever is still buffered, without erasing ahead of it
+	if (wr.target > wr.end) {
+		wr.target = wr.end;
+	}
+	int err = write_drain(0);
+	free(wr.pages);
+	wr.pages = NULL;
+	dataflash_wait_ready();
+	flags.flash_busy = 0;
+	wr.inflight = 0;
+
 	// Switch off enable flag
 	flags.sec_write_ready = 0;
 
@@ -413,12 +1011,38 @@ int flashmgt_sec_write_finish(void) {
 		return ret;
 	}
 
+	// Whatever happens now, the next attempt has to start from scratch
+	if (wr.id) {
+		resume_save(0, 0, 0);
+		wr.id = 0;
+	}
+
+	// Don't bother checking an image we failed to write
+	memset(&tempfs, 0, sizeof(tempfs));
+	if (err) {
+		ret = err;
+		goto out;
+	}
+
 	// Open the new filesystem so we can check the CRC
 	ret = flashmgt_sec_open(&tempfs);
 	if (ret) {
 		goto out;
 	}
 
+#if !CONFIG_FLASHMGT_VERIFY
+	// If the whole image streamed past in order, we already have its CRC
+	if (flags.crc_valid && wr.crc_size &&
+		wr.crc_pos >= POLYFS_32(wr.crc_size))
+	{
+		ret = (wr.crc == POLYFS_32(wr.crc_read)) ? 0 : -1;
+		if (!ret) {
+			status.update_pending = 1;
+		}
+		goto out;
+	}
+#endif
+
 	// Malloc a buffer for the CRC check
 	crcbuf = malloc(SPM_PAGESIZE);
 	if (!crcbuf) {
@@ -468,11 +1092,84 @@ bool flashmgt_update_pending(void) {
 	return status.update_pending;
 }
 
-int flashmgt_bootload(void) {
+// Check whether a page of program memory already holds buf
+static bool page_matches(uint16_t page, const uint8_t *buf) {
+	uint_farptr_t addr = (uint_farptr_t)page * SPM_PAGESIZE;
+
+	for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+		if (pgm_read_byte_far(addr + i) != buf[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#if CONFIG_LIB_LZO
+// Pages have to come out of a compressed image a whole block at a time
+verify(POLYFS_BLOCK_SIZE % SPM_PAGESIZE == 0);
+
+// The last block decompressed from the image
+static uint8_t block_buf[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+static uint16_t block_num; // block number plus one, 0 if none
+static uint16_t block_len;
+#endif
+
+// Read one page of the embedded image, padding the end with 0xff
+static int read_page(polyfs_fs_t *fs, uint8_t *buf, uint16_t page) {
+	uint32_t offset = (uint32_t)page * SPM_PAGESIZE;
+	int ret;
+
+#if CONFIG_LIB_LZO
+	if (fs->sb.flags & POLYFS_FLAG_LZO_IMAGE) {
+		uint16_t block = offset / POLYFS_BLOCK_SIZE;
+		uint16_t start = offset % POLYFS_BLOCK_SIZE;
+
+		// Decompress the block the page is in, unless we already have it
+		if (block_num != block + 1) {
+			ret = polyfs_embed_read(fs, block_buf,
+				(uint32_t)block * POLYFS_BLOCK_SIZE, sizeof(block_buf));
+			if (ret < 0) {
+				return ret;
+			}
+
+			block_num = block + 1;
+			block_len = ret;
+		}
+
+		// Copy out the page
+		ret = (block_len > start) ? block_len - start : 0;
+		if (ret > SPM_PAGESIZE) {
+			ret = SPM_PAGESIZE;
+		}
+		memcpy(buf, block_buf + start, ret);
+	}
+	else
+#endif
+	ret = polyfs_embed_read(fs, buf, offset, SPM_PAGESIZE);
+
+	if (ret < 0) {
+		return ret;
+	}
+	// Pad the bytes at the end of the last page
+	else if (ret < SPM_PAGESIZE) {
+		memset(&buf[ret], 0xff, SPM_PAGESIZE - ret);
+	}
+
+	return 0;
+}
+
+int flashmgt_bootload(struct flashmgt_bootload_stats *stats) {
 	int ret;
 	polyfs_fs_t tempfs;
 	uint32_t size;
-	static uint8_t buf[SPM_PAGESIZE];
+	static uint8_t buf[2][SPM_PAGESIZE];
+	uint8_t cur = 0;
+
+	stats->written = stats->skipped = 0;
+#if CONFIG_LIB_LZO
+	block_num = 0;
+#endif
 
 	// Don't do anything unless an update is lined up
 	if (!status.update_pending) {
@@ -489,7 +1186,7 @@ int flashmgt_bootload(void) {
 	}
 
 	// Check new filesystem CRC
-	ret = polyfs_check_crc(&tempfs, buf, SPM_PAGESIZE);
+	ret = polyfs_check_crc(&tempfs, buf[0], SPM_PAGESIZE);
 	if (ret) {
 		goto out;
 	}
@@ -507,24 +1204,56 @@ int flashmgt_bootload(void) {
 	// Loop through the entire file
 	uint16_t pages = (size + (SPM_PAGESIZE - 1)) / SPM_PAGESIZE;
 	uint16_t page = 0;
+
+	ret = read_page(&tempfs, buf[cur], page);
+	if (ret < 0) {
+		goto out;
+	}
+
 	while (page < pages) {
-		// Read a block from the file
-		ret = polyfs_embed_read(&tempfs, buf,
-				(uint32_t)page * SPM_PAGESIZE, SPM_PAGESIZE);
-		if (ret < 0) {
-			goto out;
+		bool started = false;
+
+		// Leave pages that haven't changed alone
+		if (page_matches(page, buf[cur])) {
+			stats->skipped++;
 		}
-		// Pad the bytes at the end of the last page
-		else if (ret < SPM_PAGESIZE) {
-			memset(&buf[ret], 0xff, SPM_PAGESIZE - ret);
+		// Start writing the page, if the stub lets us do it in the background
+		else if (stubboot_write_page_start(page, buf[cur]) == 0) {
+			started = true;
 		}
-
 		// Write the page
-		ret = stubboot_write_page(page, buf);
-		if (ret < 0) {
+		else {
+			ret = stubboot_write_page(page, buf[cur]);
+			if (ret < 0) {
+				goto out;
+			}
+
+			stats->written++;
+		}
+
+		// Fetch the next page into the other buffer while that goes on
+		int ret2 = 0;
+		if (page + 1 < pages) {
+			ret2 = read_page(&tempfs, buf[!cur], page + 1);
+		}
+
+		// Wait for the page to be written and check it
+		if (started) {
+			ret = stubboot_write_page_finish(page, buf[cur]);
+			if (ret < 0) {
+				goto out;
+			}
+
+			stats->written++;
+		}
+
+		// Only give up on a failed read once the flash is idle
+		if (ret2 < 0) {
+			ret = ret2;
 			goto out;
 		}
 
+		cur = !cur;
 		page++;
 	}
 	ret = 0;
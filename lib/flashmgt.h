@@ -23,19 +23,51 @@
 
 extern polyfs_fs_t *flashmgt_pfs;
 
+struct flashmgt_write_stats {
+	uint16_t erased; // blocks erased
+	uint16_t skipped; // blocks that were already blank
+	uint16_t programmed; // page program operations
+};
+
 int flashmgt_sec_open(polyfs_fs_t *ptr);
 int flashmgt_sec_close(polyfs_fs_t *ptr);
 
 #if !CONFIG_IMAGE_BOOTLOADER
-int flashmgt_sec_write_start(void);
+#include <contiki.h>
+
+// Posted to the process that called flashmgt_sec_write_start() once the
+// secondary partition is ready for writing. data is 0 on success.
+extern process_event_t flashmgt_event;
+
+// size is the expected image size, and is erased before flashmgt_event is
+// posted. Anything beyond it is erased as the data arrives; use 0 if the
+// size is not known.
+int flashmgt_sec_write_start(uint32_t size);
+
+// Like flashmgt_sec_write_start(), but carries on from where an earlier
+// write with the same non-zero id got to. *offset is set to the first
+// byte that is still needed; data before it is already in the flash and
+// must not be written again.
+int flashmgt_sec_write_resume(uint32_t id, uint32_t size, uint32_t *offset);
+// When resuming, data from before *offset must still be passed in here so
+// that it can be checked against the earlier attempt. Returns -1 if the
+// image has changed since; the resume point is then forgotten, and the
+// write has to be aborted and started again.
+int flashmgt_sec_write_check(const void *buf, uint32_t offset, uint32_t len);
 int flashmgt_sec_write_block(const void *buf, uint32_t offset, uint32_t len);
 int flashmgt_sec_write_abort(void);
 int flashmgt_sec_write_finish(void);
+void flashmgt_sec_write_stats(struct flashmgt_write_stats *ptr);
 #endif
 
 #if CONFIG_IMAGE_BOOTLOADER
+struct flashmgt_bootload_stats {
+	uint16_t written; // pages programmed
+	uint16_t skipped; // pages that already held the right data
+};
+
 bool flashmgt_update_pending(void);
-int flashmgt_bootload(void);
+int flashmgt_bootload(struct flashmgt_bootload_stats *stats);
 #endif
 
 #endif
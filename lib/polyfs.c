@@ -56,11 +56,13 @@ static inline int read_storage(polyfs_fs_t *fs, void *ptr,
 static inline int read_storage_uint32(polyfs_fs_t *fs,
 	uint32_t *ptr, uint32_t offset);
 
+// Read from a file's data blocks
+static int32_t read_blocks(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	void *ptr, uint32_t offset, uint16_t bytes, uint8_t lzo);
+
 // Read the filesystem superblock
 static int read_super(polyfs_fs_t *fs);
 
-// Calculate a CRC-32 checksum
-static uint32_t crc32(uint32_t crc, uint8_t *buffer, uint32_t length);
 
 int polyfs_init(void) {
 	int err = 0;
@@ -124,11 +126,11 @@ int polyfs_check_crc(polyfs_fs_t *fs, void *temp, uint16_t tempsize) {
 
 		// Reached the end of the filesystem
 		if (offset > size) {
-			crc = crc32(crc, temp, ret - (offset - size));
+			crc = polyfs_crc32(crc, temp, ret - (offset - size));
 			break;
 		}
 
-		crc = crc32(crc, temp, ret);
+		crc = polyfs_crc32(crc, temp, ret);
 	}
 
 	if (crc != read_crc) {
@@ -140,6 +142,14 @@ int polyfs_check_crc(polyfs_fs_t *fs, void *temp, uint16_t tempsize) {
 
 int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
 	void *ptr, uint32_t offset, uint16_t bytes)
+{
+	return read_blocks(fs, inode, ptr, offset, bytes,
+		fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION);
+}
+
+// Read from a file's blocks, which are LZO compressed if lzo is set
+static int32_t read_blocks(polyfs_fs_t *fs, const struct polyfs_inode *inode,
+	void *ptr, uint32_t offset, uint16_t bytes, uint8_t lzo)
 {
 	int err;
 
@@ -206,7 +216,7 @@ int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
 
 #if CONFIG_LIB_LZO
 	// Deal with an LZO compressed file
-	if (fs->sb.flags & POLYFS_FLAG_LZO_COMPRESSION) {
+	if (lzo) {
 		// Offset must be a multiple of the block size
 		if (offset % POLYFS_BLOCK_SIZE) {
 			PRINTF1("read offset must be a multiple of block size\n");
@@ -227,16 +237,23 @@ int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
 			return -1;
 		}
 
-		// Let's do the decompression
+		// Let's do the decompression (lzo_uint is wider than bytes on AVR)
+		lzo_uint out_len = bytes;
 		err = lzo1x_decompress_safe(ptr + lzo_offset, compr_len,
-			ptr, (lzo_uintp)&bytes, NULL);
-		if (err != LZO_E_OK || bytes != min(read_bytes, POLYFS_BLOCK_SIZE)) {
-			PRINTF("overlap decompression failed: %d, %d == %d\n",
-				   err, bytes, min(read_bytes, POLYFS_BLOCK_SIZE));
+			ptr, &out_len, NULL);
+		if (err != LZO_E_OK || out_len != min(read_bytes, POLYFS_BLOCK_SIZE)) {
+			PRINTF("overlap decompression failed: %d, %lu == %d\n",
+				   err, (unsigned long)out_len,
+				   min(read_bytes, POLYFS_BLOCK_SIZE));
 			return -1;
 		}
 
-		return bytes;
+		return out_len;
+	}
+#else
+	if (lzo) {
+		PRINTF1("LZO compression not available\n");
+		return -1;
 	}
 #endif
 
@@ -401,6 +418,11 @@ int polyfs_embed_info(polyfs_fs_t *fs, uint32_t *length) {
 		return 0;
 	}
 
+	// A compressed image starts with its uncompressed length
+	if (fs->sb.flags & POLYFS_FLAG_LZO_IMAGE) {
+		return read_storage_uint32(fs, length, sizeof(struct polyfs_super));
+	}
+
 	// Work out the root node's offset
 	*length = POLYFS_GET_OFFSET(&fs->root) << 2;
 
@@ -422,6 +444,20 @@ int polyfs_embed_read(polyfs_fs_t *fs,
 		return ret;
 	}
 
+	// A compressed image is laid out just like a compressed file, after
+	// the length, so read it the same way
+	if (fs->sb.flags & POLYFS_FLAG_LZO_IMAGE) {
+		struct polyfs_inode inode;
+
+		memset(&inode, 0, sizeof(inode));
+		inode.mode = POLYFS_16(S_IFREG);
+		inode.size = POLYFS_24(size);
+		POLYFS_SET_OFFSET(&inode,
+			(sizeof(struct polyfs_super) + sizeof(uint32_t)) >> 2);
+
+		return read_blocks(fs, &inode, ptr, offset, bytes, 1);
+	}
+
 	// Check we aren't trying to read past the end of the file
 	if (offset > size) {
 		return -1;
@@ -550,7 +586,9 @@ static int read_super(polyfs_fs_t *fs) {
 // CCITT CRC-32 (Autodin II) polynomial:
 // X32+X26+X23+X22+X16+X12+X11+X10+X8+X7+X5+X4+X2+X+1
 
-static uint32_t crc32(uint32_t crc, uint8_t *buffer, uint32_t length) {
+uint32_t polyfs_crc32(uint32_t crc, const void *ptr, uint32_t length) {
+	const uint8_t *buffer = ptr;
+
 	if (buffer == NULL) {
 		return 0;
 	}
@@ -55,6 +55,10 @@ int polyfs_fs_open(polyfs_fs_t *fs);
 
 int polyfs_check_crc(polyfs_fs_t *fs, void *temp, uint16_t tempsize);
 
+// The CRC-32 used by polyfs_check_crc(), for checking an image as it
+// streams past. Chain calls by passing the previous result in crc.
+uint32_t polyfs_crc32(uint32_t crc, const void *ptr, uint32_t length);
+
 int32_t polyfs_fread(polyfs_fs_t *fs, const struct polyfs_inode *inode,
 	void *ptr, uint32_t offset, uint16_t bytes);
 
@@ -125,18 +125,14 @@ int cfs_read(int fd, void *buf, unsigned int len) {
 
 	fdp = &fds[fd];
 
-	// Shorten the read if it would go past the end of file
-	if (fdp->offset + len > fdp->inode.size) {
-		len = fdp->inode.size - fdp->offset;
+	// Forward the read to PolyFS, which stops at the end of the file itself.
+	// Don't shorten len here: LZO blocks need the whole buffer to decompress.
+	int32_t ret = polyfs_fread(polyfs_cfs_fs, &fdp->inode, buf, fdp->offset, len);
+	if (ret > 0) {
+		fdp->offset += ret;
 	}
 
-	// Forward the read to PolyFS
-	len = polyfs_fread(polyfs_cfs_fs, &fdp->inode, buf, fdp->offset, len);
-	if (len > 0) {
-		fdp->offset += len;
-	}
-
-	return len;
+	return ret;
 }
 
 int cfs_write(int fd, const void *buf, unsigned int len) {
@@ -43,7 +43,6 @@ static int pfsdf_read(polyfs_fs_t *fs, void *ptr,
 {
 	struct pfsdf_info *iptr = fs->userptr;
 	int err;
-	uint8_t sreg;
 
 	// Check the inputs are in range
 	if (offset >= iptr->bytes) {
@@ -56,9 +55,10 @@ static int pfsdf_read(polyfs_fs_t *fs, void *ptr,
 		bytes = iptr->bytes - offset;
 	}
 
-	// Make sure the flash is ready
-	err = dataflash_read_status(&sreg);
-	if ((err) || (sreg & DATAFLASH_SREG_BUSY)) {
+	// Make sure the flash is ready. A firmware update may be erasing or
+	// programming the other partition in the background.
+	err = dataflash_wait_ready();
+	if (err) {
 		return -1;
 	}
 
@@ -67,8 +67,17 @@ static int pfsdf_read(polyfs_fs_t *fs, void *ptr,
 }
 
 int pfsdf_open(polyfs_fs_t *fs, uint32_t offset, uint32_t size) {
+	const dataflash_geometry_t *geom = dataflash_geometry();
 	struct pfsdf_info *iptr = NULL;
 
+	// Make sure the flash chip was found and the filesystem is on it
+	if (!geom || offset >= geom->size) {
+		return -1;
+	}
+	else if (size > geom->size - offset) {
+		size = geom->size - offset;
+	}
+
 	// Sanity check
 	if (size < sizeof(struct polyfs_super)) {
 		return -1;
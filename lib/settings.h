@@ -16,6 +16,7 @@ typedef enum {
 } settings_status_t;
 
 #define SETTINGS_KEY_FLASHMGT_STATUS	0x0100
+#define SETTINGS_KEY_FLASHMGT_RESUME	0x0101
 
 #define SETTINGS_INVALID_KEY	(0x00)
 #define SETTINGS_MAX_VALUE_SIZE	(0x3FFF)	// 16383 bytes
@@ -55,6 +55,50 @@ int stubboot_write_page(uint16_t page, const void *addr) {
 	return ret;
 }
 
+int stubboot_write_page_start(uint16_t page, const void *addr) {
+	int ret;
+
+	// Read the table if we haven't yet
+	if (!table.write_page) {
+		stubboot_read_table(&table);
+		if (!table.write_page) {
+			return -1;
+		}
+	}
+
+	// Check the version number; older stubs don't have this
+	if (table.ver_major != 0x01 || table.ver_minor < 1 ||
+		!table.write_page_start)
+	{
+		return -1;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		// Call the function
+		ret = table.write_page_start(page, addr);
+	}
+
+	return ret;
+}
+
+int stubboot_write_page_finish(uint16_t page, const void *addr) {
+	int ret;
+
+	// Only valid after stubboot_write_page_start() has succeeded
+	if (table.ver_major != 0x01 || table.ver_minor < 1 ||
+		!table.write_page_finish)
+	{
+		return -1;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		// Call the function
+		ret = table.write_page_finish(page, addr);
+	}
+
+	return ret;
+}
+
 #if !CONFIG_IMAGE_BOOTLOADER
 int stubboot_update_loader(uint8_t pages, uint16_t crc, void *addr) {
 	int ret;
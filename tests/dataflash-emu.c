@@ -0,0 +1,698 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Host implementation of the drivers/dataflash.h API, emulating the
+ * AT26DF081A on PC_MB_001 on top of an image file.
+ *
+ * The device behaves like the real one as far as the firmware can tell:
+ * erases work on whole 4K/32K/64K blocks, programming can only clear bits
+ * and stays within one page, sectors are protected at power-up, SPRL and
+ * WEL work as documented, and erasing or programming leaves the device
+ * BUSY for a while. Commands the real device would refuse or ignore fail
+ * here and are counted in the stats.
+ *
+ * Time is simulated: every call is charged for its SPI traffic and busy
+ * periods run on the same clock, so polling loops terminate and the stats
+ * give the time an operation would take on the board.
+ *
+ * Link it in instead of drivers/dataflash.c; see dataflash-sim.c for an
+ * example.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dataflash-emu.h"
+
+#define FLASH_SIZE DATAFLASH_EMU_SIZE
+
+#define MFR_CT_ATMEL 0x00
+#define MFR_ID_ATMEL 0x1f
+#define DEV_ID_AT26DF081A_P1 0x45
+#define DEV_ID_AT26DF081A_P2 0x01
+
+// Bytes of opcode and address in a command, plus the fast read dummy byte
+#define CMD_BYTES 1
+#define ADDR_CMD_BYTES 4
+#define READ_CMD_BYTES 5
+
+/*
+ * Default timings. The SPI costs match the model in polyfs-bench.c; the
+ * device figures are the typical values from the AT26DF081A datasheet.
+ */
+struct dataflash_emu_timing dataflash_emu_timing = {
+	.txn_ns = 15000,
+	.byte_ns = 2000,
+	.program_ns = 1500000,
+	.erase_4k_ns = 50000000,
+	.erase_32k_ns = 250000000,
+	.erase_64k_ns = 400000000,
+	.erase_chip_ns = 9000000000ULL,
+};
+
+static const dataflash_sector_t sectors[] = {
+	{ 0x00000, 0x0ffff }, // 0: 64K
+	{ 0x10000, 0x1ffff }, // 1: 64K
+	{ 0x20000, 0x2ffff }, // 2: 64K
+	{ 0x30000, 0x3ffff }, // 3: 64K
+	{ 0x40000, 0x4ffff }, // 4: 64K
+	{ 0x50000, 0x5ffff }, // 5: 64K
+	{ 0x60000, 0x6ffff }, // 6: 64K
+	{ 0x70000, 0x7ffff }, // 7: 64K
+	{ 0x80000, 0x8ffff }, // 8: 64K
+	{ 0x90000, 0x9ffff }, // 9: 64K
+	{ 0xa0000, 0xaffff }, // 10: 64K
+	{ 0xb0000, 0xbffff }, // 11: 64K
+	{ 0xc0000, 0xcffff }, // 12: 64K
+	{ 0xd0000, 0xdffff }, // 13: 64K
+	{ 0xe0000, 0xeffff }, // 14: 64K
+	{ 0xf0000, 0xf3fff }, // 15: 16K
+	{ 0xf4000, 0xf5fff }, // 16: 8K
+	{ 0xf6000, 0xf7fff }, // 17: 8K
+	{ 0xf8000, 0xfffff }, // 18: 32K
+};
+
+#define NUM_SECTORS (sizeof(sectors) / sizeof(dataflash_sector_t))
+
+static struct {
+	int fd;
+	uint8_t inited;
+	uint8_t sprl;
+	uint8_t wel;
+	uint8_t epe;
+	uint8_t prot[NUM_SECTORS];
+	uint64_t busy_until;
+} dev = {
+	.fd = -1,
+};
+
+static struct dataflash_emu_stats stats;
+
+static const dataflash_geometry_t geom = {
+	.size = FLASH_SIZE,
+	.page_size = DATAFLASH_WR_PAGE_SIZE,
+	.erase_sizes = DATAFLASH_ERASE_4K | DATAFLASH_ERASE_32K |
+		DATAFLASH_ERASE_64K,
+	.read_cmd = 0x0b,
+	.read_dummy = 1,
+	.max_sck_mhz = 70,
+};
+
+// Charge for a transaction that moves this many bytes over SPI
+static uint64_t spi(uint32_t bytes) {
+	uint64_t ns = dataflash_emu_timing.txn_ns +
+		(uint64_t)bytes * dataflash_emu_timing.byte_ns;
+
+	stats.now_ns += ns;
+	return ns;
+}
+
+static int busy(void) {
+	return stats.now_ns < dev.busy_until;
+}
+
+static void start_busy(uint64_t ns) {
+	dev.busy_until = stats.now_ns + ns;
+}
+
+// Refuse a command; the device drops WEL when it rejects one
+static int refuse(void) {
+	dev.wel = 0;
+	stats.errors++;
+	return -1;
+}
+
+// Checks common to all commands that change the array or the protection
+static int check_write(void) {
+	if (!dev.inited) {
+		return -1;
+	}
+
+	// The device ignores everything but status reads while busy
+	if (busy()) {
+		stats.errors++;
+		return -1;
+	}
+
+	if (!dev.wel) {
+		stats.errors++;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Is any sector that overlaps [start, end] protected?
+static int range_protected(uint32_t start, uint32_t end) {
+	for (unsigned int i = 0; i < NUM_SECTORS; i++) {
+		if (sectors[i].start <= end && sectors[i].end >= start && dev.prot[i]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// The file holds the inverted contents, so erased areas can be holes
+static int image_read(uint8_t *buf, uint32_t offset, uint32_t bytes) {
+	ssize_t ret = pread(dev.fd, buf, bytes, offset);
+
+	if (ret != bytes) {
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < bytes; i++) {
+		buf[i] = ~buf[i];
+	}
+
+	return 0;
+}
+
+static int image_write(const uint8_t *buf, uint32_t offset, uint32_t bytes) {
+	uint8_t temp[DATAFLASH_WR_PAGE_SIZE];
+
+	for (uint32_t i = 0; i < bytes; i++) {
+		temp[i] = ~buf[i];
+	}
+
+	return pwrite(dev.fd, temp, bytes, offset) == bytes ? 0 : -1;
+}
+
+static int image_erase(uint32_t offset, uint32_t bytes) {
+	static const uint8_t zero[DATAFLASH_SECTOR_4K_SIZE];
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (!fallocate(dev.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		offset, bytes))
+	{
+		return 0;
+	}
+#endif
+
+	// No hole punching on this filesystem, write the zeros out
+	for (uint32_t done = 0; done < bytes; done += sizeof(zero)) {
+		if (pwrite(dev.fd, zero, sizeof(zero), offset + done) != sizeof(zero)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int dataflash_emu_open(const char *path) {
+	struct stat s;
+
+	if (dev.fd >= 0) {
+		dataflash_emu_close();
+	}
+
+	dev.fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (dev.fd < 0) {
+		return -1;
+	}
+
+	// A new or short image is blank past its end
+	if (fstat(dev.fd, &s) || (s.st_size < FLASH_SIZE &&
+		ftruncate(dev.fd, FLASH_SIZE)))
+	{
+		dataflash_emu_close();
+		return -1;
+	}
+
+	// Power-up state: everything protected, SPRL and WEL clear
+	dev.inited = 1;
+	dev.sprl = 0;
+	dev.wel = 0;
+	dev.epe = 0;
+	memset(dev.prot, 1, sizeof(dev.prot));
+	dev.busy_until = 0;
+	memset(&stats, 0, sizeof(stats));
+
+	return 0;
+}
+
+void dataflash_emu_close(void) {
+	if (dev.fd >= 0) {
+		close(dev.fd);
+	}
+
+	dev.fd = -1;
+	dev.inited = 0;
+}
+
+void dataflash_emu_advance(uint64_t ns) {
+	stats.now_ns += ns;
+}
+
+const struct dataflash_emu_stats *dataflash_emu_stats(void) {
+	return &stats;
+}
+
+void dataflash_emu_reset_stats(void) {
+	// Keep any operation in progress running on the new clock
+	dev.busy_until = busy() ? dev.busy_until - stats.now_ns : 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+const dataflash_geometry_t *dataflash_geometry(void) {
+	return dev.inited ? &geom : NULL;
+}
+
+int dataflash_read_id(dataflash_id_t *id, uint8_t *extinfo, uint8_t bufsz) {
+	if (!dev.inited) {
+		return -1;
+	}
+
+	stats.status_ns += spi(CMD_BYTES + 5);
+
+	id->num_cont = MFR_CT_ATMEL;
+	id->mfr_id = MFR_ID_ATMEL;
+	id->devid1 = DEV_ID_AT26DF081A_P1;
+	id->devid2 = DEV_ID_AT26DF081A_P2;
+	// No extended device information
+	id->extinfo_len = 0;
+	(void)extinfo;
+	(void)bufsz;
+
+	return 0;
+}
+
+int dataflash_sector_from_addr(uint32_t addr, dataflash_sector_t *sector) {
+	for (unsigned int i = 0; i < NUM_SECTORS; i++) {
+		if (sectors[i].start <= addr && sectors[i].end >= addr) {
+			*sector = sectors[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int dataflash_sector_by_idx(uint8_t idx, dataflash_sector_t *sector) {
+	if (idx >= NUM_SECTORS) {
+		return -1;
+	}
+
+	*sector = sectors[idx];
+	return 0;
+}
+
+int dataflash_sector_range(uint32_t start, uint32_t end,
+	int (*fn)(const dataflash_sector_t *sector, void *arg), void *arg)
+{
+	int ret;
+
+	if (start >= FLASH_SIZE || end < start) {
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < NUM_SECTORS && sectors[i].start <= end; i++) {
+		if (sectors[i].end < start) {
+			continue;
+		}
+
+		ret = fn(&sectors[i], arg);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int dataflash_read_status(uint8_t *sreg) {
+	int prot = 0;
+
+	if (!dev.inited) {
+		return -1;
+	}
+
+	stats.status_ns += spi(CMD_BYTES + 1);
+	stats.polls++;
+
+	for (unsigned int i = 0; i < NUM_SECTORS; i++) {
+		prot += dev.prot[i];
+	}
+
+	*sreg = 0;
+	if (dev.sprl) {
+		*sreg |= DATAFLASH_SREG_SPRL;
+	}
+	if (dev.epe) {
+		*sreg |= DATAFLASH_SREG_EPE;
+	}
+	if (prot == NUM_SECTORS) {
+		*sreg |= DATAFLASH_SREG_SWP1 | DATAFLASH_SREG_SWP0;
+	}
+	else if (prot) {
+		*sreg |= DATAFLASH_SREG_SWP0;
+	}
+	if (dev.wel) {
+		*sreg |= DATAFLASH_SREG_WEL;
+	}
+	if (busy()) {
+		*sreg |= DATAFLASH_SREG_BUSY;
+	}
+
+	return 0;
+}
+
+int dataflash_write_status(uint8_t sreg) {
+	if (check_write()) {
+		return -1;
+	}
+
+	stats.status_ns += spi(CMD_BYTES + 1);
+
+	// Global protect/unprotect only works while SPRL is clear
+	if (!dev.sprl) {
+		if ((sreg & 0x3c) == 0x3c) {
+			memset(dev.prot, 1, sizeof(dev.prot));
+		}
+		else if ((sreg & 0x3c) == 0x00) {
+			memset(dev.prot, 0, sizeof(dev.prot));
+		}
+	}
+
+	// WP is never asserted on the board, so SPRL can always be changed
+	dev.sprl = !!(sreg & DATAFLASH_SREG_SPRL);
+	dev.wel = 0;
+
+	return 0;
+}
+
+int dataflash_wait_ready(void) {
+	if (!dev.inited) {
+		return -1;
+	}
+
+	stats.status_ns += spi(CMD_BYTES + 1);
+	stats.polls++;
+
+	// Clock out status bytes until the device is done
+	if (busy()) {
+		stats.wait_ns += dev.busy_until - stats.now_ns;
+		stats.now_ns = dev.busy_until;
+	}
+
+	return 0;
+}
+
+int dataflash_busy(void) {
+	uint8_t sreg;
+	int err;
+
+	err = dataflash_read_status(&sreg);
+	if (err) {
+		return err;
+	}
+
+	return (sreg & DATAFLASH_SREG_BUSY) ? 1 : 0;
+}
+
+int dataflash_read_data(void *buf, uint32_t offset, uint32_t bytes) {
+	if (!dev.inited || offset >= FLASH_SIZE) {
+		return -1;
+	}
+	else if (bytes == 0) {
+		return 0;
+	}
+	else if (offset + bytes > FLASH_SIZE) {
+		bytes = FLASH_SIZE - offset;
+	}
+
+	if (busy()) {
+		stats.errors++;
+		return -1;
+	}
+
+	stats.read_ns += spi(READ_CMD_BYTES + bytes);
+	stats.reads++;
+	stats.read_bytes += bytes;
+
+	if (image_read(buf, offset, bytes)) {
+		return -1;
+	}
+
+	return bytes;
+}
+
+int dataflash_check_blank(uint32_t offset, uint32_t bytes) {
+	uint8_t temp[DATAFLASH_WR_PAGE_SIZE];
+	uint32_t done = 0;
+	int blank = 1;
+
+	if (!dev.inited || offset >= FLASH_SIZE) {
+		return -1;
+	}
+	else if (offset + bytes > FLASH_SIZE) {
+		bytes = FLASH_SIZE - offset;
+	}
+
+	if (busy()) {
+		stats.errors++;
+		return -1;
+	}
+
+	// Stop at the first byte that has been programmed
+	while (done < bytes && blank) {
+		uint32_t chunk = bytes - done;
+
+		if (chunk > sizeof(temp)) {
+			chunk = sizeof(temp);
+		}
+		if (image_read(temp, offset + done, chunk)) {
+			return -1;
+		}
+
+		for (uint32_t i = 0; i < chunk && blank; i++, done++) {
+			blank = temp[i] == 0xff;
+		}
+	}
+
+	stats.read_ns += spi(READ_CMD_BYTES + done);
+	stats.reads++;
+	stats.read_bytes += done;
+
+	return blank;
+}
+
+int dataflash_write_enable(void) {
+	if (!dev.inited) {
+		return -1;
+	}
+
+	stats.write_ns += spi(CMD_BYTES);
+
+	if (busy()) {
+		stats.errors++;
+		return -1;
+	}
+
+	dev.wel = 1;
+	return 0;
+}
+
+int dataflash_write_disable(void) {
+	if (!dev.inited) {
+		return -1;
+	}
+
+	stats.write_ns += spi(CMD_BYTES);
+
+	if (busy()) {
+		stats.errors++;
+		return -1;
+	}
+
+	dev.wel = 0;
+	return 0;
+}
+
+static int set_protection(uint32_t addr, uint8_t value) {
+	if (check_write() || addr >= FLASH_SIZE) {
+		return -1;
+	}
+
+	stats.write_ns += spi(ADDR_CMD_BYTES);
+
+	if (dev.sprl) {
+		return refuse();
+	}
+
+	for (unsigned int i = 0; i < NUM_SECTORS; i++) {
+		if (sectors[i].start <= addr && sectors[i].end >= addr) {
+			dev.prot[i] = value;
+		}
+	}
+
+	dev.wel = 0;
+
+	return 0;
+}
+
+int dataflash_protect_sector(uint32_t addr) {
+	return set_protection(addr, 1);
+}
+
+int dataflash_unprotect_sector(uint32_t addr) {
+	return set_protection(addr, 0);
+}
+
+int dataflash_read_protection(uint32_t addr, uint8_t *value) {
+	dataflash_sector_t sector;
+
+	if (!dev.inited || dataflash_sector_from_addr(addr, &sector)) {
+		return -1;
+	}
+
+	stats.status_ns += spi(ADDR_CMD_BYTES + 1);
+
+	*value = range_protected(addr, addr) ? 0xff : 0x00;
+	return 0;
+}
+
+static int erase(uint32_t addr, uint32_t size, uint64_t ns) {
+	uint32_t start = addr & ~(size - 1);
+
+	if (check_write() || addr >= FLASH_SIZE) {
+		return -1;
+	}
+
+	stats.write_ns += spi(ADDR_CMD_BYTES);
+
+	// The device refuses to erase anything protected and flags it in EPE
+	if (range_protected(start, start + size - 1)) {
+		dev.epe = 1;
+		return refuse();
+	}
+
+	if (image_erase(start, size)) {
+		return -1;
+	}
+
+	dev.epe = 0;
+	dev.wel = 0;
+	start_busy(ns);
+	stats.erase_ns += ns;
+
+	return 0;
+}
+
+int dataflash_erase_4k(uint32_t addr) {
+	int ret = erase(addr, DATAFLASH_SECTOR_4K_SIZE,
+		dataflash_emu_timing.erase_4k_ns);
+
+	if (!ret) {
+		stats.erases_4k++;
+	}
+
+	return ret;
+}
+
+int dataflash_erase_32k(uint32_t addr) {
+	int ret = erase(addr, DATAFLASH_SECTOR_32K_SIZE,
+		dataflash_emu_timing.erase_32k_ns);
+
+	if (!ret) {
+		stats.erases_32k++;
+	}
+
+	return ret;
+}
+
+int dataflash_erase_64k(uint32_t addr) {
+	int ret = erase(addr, DATAFLASH_SECTOR_64K_SIZE,
+		dataflash_emu_timing.erase_64k_ns);
+
+	if (!ret) {
+		stats.erases_64k++;
+	}
+
+	return ret;
+}
+
+int dataflash_erase_chip(void) {
+	int ret = erase(0, FLASH_SIZE, dataflash_emu_timing.erase_chip_ns);
+
+	if (!ret) {
+		stats.erases_chip++;
+	}
+
+	return ret;
+}
+
+int dataflash_write_data(const void *buf, uint32_t addr, uint16_t bytes) {
+	const uint8_t *cbuf = buf;
+	uint8_t temp[DATAFLASH_WR_PAGE_SIZE];
+	uint32_t page_end = (addr & DATAFLASH_WR_PAGE_MASK) +
+		DATAFLASH_WR_PAGE_SIZE;
+
+	if (!dev.inited || addr >= FLASH_SIZE) {
+		return -1;
+	}
+	else if (bytes == 0) {
+		return 0;
+	}
+
+	// Clamp write size to the end of the write page
+	if (addr + bytes > page_end) {
+		bytes = page_end - addr;
+	}
+
+	if (check_write()) {
+		return -1;
+	}
+
+	stats.write_ns += spi(ADDR_CMD_BYTES + bytes);
+
+	if (range_protected(addr, addr + bytes - 1)) {
+		dev.epe = 1;
+		return refuse();
+	}
+
+	// Programming can only clear bits
+	if (image_read(temp, addr, bytes)) {
+		return -1;
+	}
+	for (uint16_t i = 0; i < bytes; i++) {
+		temp[i] &= cbuf[i];
+	}
+	if (image_write(temp, addr, bytes)) {
+		return -1;
+	}
+
+	dev.epe = 0;
+	dev.wel = 0;
+	start_busy(dataflash_emu_timing.program_ns);
+	stats.program_ns += dataflash_emu_timing.program_ns;
+	stats.pages++;
+	stats.program_bytes += bytes;
+
+	return bytes;
+}
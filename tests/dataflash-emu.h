@@ -0,0 +1,85 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef DATAFLASH_EMU_H
+#define DATAFLASH_EMU_H
+
+#include <stdint.h>
+
+#include "../drivers/dataflash.h"
+
+#define DATAFLASH_EMU_SIZE 1048576
+
+// How long things take on the emulated device, in nanoseconds
+struct dataflash_emu_timing {
+	// SPI costs, as seen by the AVR
+	uint32_t txn_ns;
+	uint32_t byte_ns;
+
+	// Internal operations, while the device reports BUSY
+	uint64_t program_ns;
+	uint64_t erase_4k_ns;
+	uint64_t erase_32k_ns;
+	uint64_t erase_64k_ns;
+	uint64_t erase_chip_ns;
+};
+
+struct dataflash_emu_stats {
+	// Simulated time since the device was opened or the stats were reset
+	uint64_t now_ns;
+
+	// Time spent talking to the device over SPI, by operation
+	uint64_t read_ns;
+	uint64_t write_ns;
+	uint64_t status_ns;
+
+	// Time the device spent busy, and how much of it was spent waiting
+	uint64_t program_ns;
+	uint64_t erase_ns;
+	uint64_t wait_ns;
+
+	unsigned long reads;
+	unsigned long long read_bytes;
+	unsigned long pages;
+	unsigned long long program_bytes;
+	unsigned long erases_4k;
+	unsigned long erases_32k;
+	unsigned long erases_64k;
+	unsigned long erases_chip;
+	unsigned long polls;
+
+	// Commands that the device would have refused or ignored
+	unsigned long errors;
+};
+
+extern struct dataflash_emu_timing dataflash_emu_timing;
+
+// Open the image that backs the device, creating it if needed. Erased
+// bytes are stored inverted so that the file can stay sparse.
+int dataflash_emu_open(const char *path);
+void dataflash_emu_close(void);
+
+// Let time pass, e.g. for the work the caller does between polls
+void dataflash_emu_advance(uint64_t ns);
+
+const struct dataflash_emu_stats *dataflash_emu_stats(void);
+void dataflash_emu_reset_stats(void);
+
+#endif /* DATAFLASH_EMU_H */
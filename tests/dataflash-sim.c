@@ -0,0 +1,371 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Exercises the dataflash emulator in dataflash-emu.c.
+ *
+ * Without an image, checks that the emulator behaves like the device,
+ * scribbling over the start of the flash file.
+ * With a polyfs image, runs lib/flashmgt.c itself on top of the emulator
+ * to write it to the update partition, the way a TFTP download does, and
+ * prints the simulated time it took. Contiki and the settings store are
+ * stood in for by the code in host/.
+ *
+ * Build with something like:
+ *   gcc -std=gnu99 -O2 -Wall -D_GNU_SOURCE -include sys/stat.h \
+ *     -DCONFIG_LIB_LZO=1 -Ihost -I../include -I../lib -I../lib/minilzo \
+ *     -I.. -o dataflash-sim \
+ *     dataflash-sim.c dataflash-emu.c host/contiki.c host/settings.c \
+ *     ../lib/flashmgt.c ../lib/polyfs.c ../lib/polyfs_df.c \
+ *     ../lib/minilzo/minilzo.c
+ *
+ * Without CONFIG_LIB_LZO and minilzo.c, LZO images (the usual firmware
+ * image) fail the check in flashmgt_sec_write_finish().
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <contiki.h>
+#include <init.h>
+#include <polyfs.h>
+#include <flashmgt.h>
+
+#include "dataflash-emu.h"
+
+// Data is handed to flashmgt in TFTP-sized blocks
+#define WRITE_CHUNK 512
+
+#define NS_PER_TICK (1000000000ULL / CLOCK_SECOND)
+
+// Entries made by INIT_LIBRARY(), found by the linker
+extern const struct init_entry __start__init_libraries[];
+extern const struct init_entry __stop__init_libraries[];
+
+PROCESS_NAME(flashmgt_process);
+PROCESS(sim_process, "sim");
+
+// Simulated time from before the last stats reset
+static uint64_t clock_base_ns;
+
+// Result of the erase, from flashmgt_event
+static int erase_result;
+static uint8_t erase_done;
+
+clock_time_t clock_time(void) {
+	return (clock_base_ns + dataflash_emu_stats()->now_ns) / NS_PER_TICK;
+}
+
+static void reset_stats(void) {
+	clock_base_ns += dataflash_emu_stats()->now_ns;
+	dataflash_emu_reset_stats();
+}
+
+PROCESS_THREAD(sim_process, ev, data) {
+	PROCESS_BEGIN();
+
+	while (1) {
+		PROCESS_WAIT_EVENT_UNTIL(ev == flashmgt_event);
+		erase_result = (intptr_t)data;
+		erase_done = 1;
+	}
+
+	PROCESS_END();
+}
+
+// Run the processes until they have nothing left to do, letting the
+// simulated time pass while they wait on timers
+static void run(void) {
+	while (1) {
+		if (process_run()) {
+			continue;
+		}
+		if (!etimer_pending()) {
+			break;
+		}
+
+		clock_time_t next = etimer_next_expiration_time();
+		while (clock_time() < next) {
+			dataflash_emu_advance(NS_PER_TICK);
+		}
+	}
+}
+
+static void unlock_all(void) {
+	int err;
+
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_write_status(0x00);
+	assert(err == 0);
+}
+
+static void wait_ready(void) {
+	int ret;
+
+	while ((ret = dataflash_busy()) > 0) {
+	}
+	assert(ret == 0);
+}
+
+static int self_test(void) {
+	const struct dataflash_emu_stats *stats = dataflash_emu_stats();
+	uint8_t buf[DATAFLASH_WR_PAGE_SIZE];
+	uint8_t across[DATAFLASH_WR_PAGE_SIZE + 1];
+	uint8_t sreg, prot;
+	int err;
+
+	// Everything is protected at power-up
+	err = dataflash_read_status(&sreg);
+	assert(err == 0);
+	assert((sreg & (DATAFLASH_SREG_SWP1 | DATAFLASH_SREG_SWP0)) ==
+		(DATAFLASH_SREG_SWP1 | DATAFLASH_SREG_SWP0));
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_erase_4k(0);
+	assert(err < 0);
+	err = dataflash_read_status(&sreg);
+	assert(err == 0);
+	assert(sreg & DATAFLASH_SREG_EPE);
+	assert(!(sreg & DATAFLASH_SREG_WEL));
+
+	// Nothing happens without WEL
+	unlock_all();
+	err = dataflash_erase_4k(0);
+	assert(err < 0);
+
+	// Erase leaves the device busy, and it ignores commands until done
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_erase_4k(0x1234);
+	assert(err == 0);
+	assert(dataflash_busy() == 1);
+	err = dataflash_read_data(buf, 0, sizeof(buf));
+	assert(err < 0);
+	wait_ready();
+	assert(stats->erases_4k == 1);
+	assert(dataflash_check_blank(0, DATAFLASH_SECTOR_4K_SIZE) == 1);
+
+	// Programming only clears bits, and stays within the page
+	memset(buf, 0x0f, sizeof(buf));
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_write_data(buf, 0x10, sizeof(buf));
+	assert(err == sizeof(buf) - 0x10);
+	wait_ready();
+	memset(buf, 0xf5, sizeof(buf));
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_write_data(buf, 0x10, 16);
+	assert(err == 16);
+	wait_ready();
+	err = dataflash_read_data(across, 0, sizeof(across));
+	assert(err == sizeof(across));
+	assert(across[0x0f] == 0xff && across[0x10] == 0x05 &&
+		across[0x20] == 0x0f && across[sizeof(buf)] == 0xff);
+	assert(dataflash_check_blank(0, 16) == 1);
+	assert(dataflash_check_blank(0, 17) == 0);
+
+	// Sector protection, and SPRL locking it
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_protect_sector(0xf4000);
+	assert(err == 0);
+	err = dataflash_read_protection(0xf5fff, &prot);
+	assert(err == 0 && prot == 0xff);
+	err = dataflash_read_protection(0xf6000, &prot);
+	assert(err == 0 && prot == 0x00);
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_erase_32k(0xf0000);
+	assert(err < 0);
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_write_status(DATAFLASH_SREG_SPRL | 0x24);
+	assert(err == 0);
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_unprotect_sector(0xf4000);
+	assert(err < 0);
+	unlock_all();
+	err = dataflash_read_protection(0xf4000, &prot);
+	assert(err == 0 && prot == 0xff);
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_write_status(0x00);
+	assert(err == 0);
+	err = dataflash_read_protection(0xf4000, &prot);
+	assert(err == 0 && prot == 0x00);
+
+	// Erased data reads back blank again
+	err = dataflash_write_enable();
+	assert(err == 0);
+	err = dataflash_erase_64k(0x8000);
+	assert(err == 0);
+	wait_ready();
+	assert(dataflash_check_blank(0, DATAFLASH_SECTOR_64K_SIZE) == 1);
+
+	printf("dataflash emulator self-test passed (%lu refused commands)\n",
+		stats->errors);
+	return 0;
+}
+
+static void print_stats(const char *name) {
+	const struct dataflash_emu_stats *stats = dataflash_emu_stats();
+
+	printf("%-8s %10.1f %8.1f %8.1f %8.1f %8.1f %8.1f %6lu %6lu %3lu/%lu/%lu %7lu\n",
+		name,
+		stats->now_ns / 1e6,
+		stats->read_ns / 1e6,
+		stats->write_ns / 1e6,
+		stats->status_ns / 1e6,
+		stats->program_ns / 1e6,
+		stats->erase_ns / 1e6,
+		stats->reads, stats->pages,
+		stats->erases_4k, stats->erases_32k, stats->erases_64k,
+		stats->polls);
+}
+
+static int write_image(const char *file) {
+	static uint8_t image[DATAFLASH_EMU_SIZE];
+	uint8_t check[WRITE_CHUNK];
+	struct flashmgt_write_stats fstats;
+	polyfs_fs_t fs;
+	uint32_t size;
+	int err;
+
+	FILE *f = fopen(file, "r");
+	if (!f) {
+		printf("failed to open file: %s\n", file);
+		return 1;
+	}
+	size = fread(image, 1, sizeof(image), f);
+	fclose(f);
+
+	// Bring flashmgt up as the firmware would. Without a status record in
+	// the settings its init fails after locking the flash, which leaves
+	// updates going to the second half as on a new board.
+	polyfs_init();
+	for (const struct init_entry *ent = __start__init_libraries;
+		ent < __stop__init_libraries; ent++)
+	{
+		ent->fn();
+	}
+	process_start(&flashmgt_process, NULL);
+	process_start(&sim_process, NULL);
+
+	printf("%-8s %10s %8s %8s %8s %8s %8s %6s %6s %9s %7s\n",
+		"phase", "total ms", "read", "write", "status",
+		"program", "erase", "reads", "pages", "4k/32k/64k", "polls");
+
+	reset_stats();
+
+	// The area the image takes is erased before any data is accepted
+	if (flashmgt_sec_write_start(size)) {
+		printf("flashmgt_sec_write_start failed\n");
+		return 1;
+	}
+	run();
+	if (!erase_done || erase_result) {
+		printf("erase failed: %d\n", erase_result);
+		return 1;
+	}
+	print_stats("erase");
+	reset_stats();
+
+	for (uint32_t done = 0; done < size; done += WRITE_CHUNK) {
+		uint32_t chunk = size - done < WRITE_CHUNK ? size - done : WRITE_CHUNK;
+
+		err = flashmgt_sec_write_block(image + done, done, chunk);
+		if (err) {
+			printf("write failed at 0x%05x: %d\n", done, err);
+			return 1;
+		}
+		run();
+	}
+	err = flashmgt_sec_write_finish();
+	print_stats("program");
+	if (err) {
+		printf("flashmgt_sec_write_finish failed: %d\n", err);
+		return 1;
+	}
+	reset_stats();
+
+	// Read it back through polyfs, as the bootloader will
+	if (flashmgt_sec_open(&fs)) {
+		printf("cannot open the new filesystem\n");
+		return 1;
+	}
+	for (uint32_t done = 0; done < size; done += sizeof(check)) {
+		uint32_t chunk = size - done < sizeof(check) ? size - done : sizeof(check);
+
+		err = fs.fn_read(&fs, check, done, chunk);
+		if (err != (int)chunk || memcmp(check, image + done, chunk)) {
+			printf("verify failed at 0x%05x\n", done);
+			return 1;
+		}
+	}
+	flashmgt_sec_close(&fs);
+	print_stats("verify");
+
+	flashmgt_sec_write_stats(&fstats);
+	printf("%u bytes, %u blocks erased, %u already blank, %u page programs\n",
+		size, fstats.erased, fstats.skipped, fstats.programmed);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int c;
+
+	while ((c = getopt(argc, argv, "b:t:")) != -1) {
+		switch (c) {
+		case 'b':
+			dataflash_emu_timing.byte_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			dataflash_emu_timing.txn_ns = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if (argc - optind < 1 || argc - optind > 2) {
+		printf("Usage: %s [-t ns/transaction] [-b ns/byte] "
+			"<flash.bin> [image.pfs]\n", argv[0]);
+		return 1;
+	}
+
+	if (dataflash_emu_open(argv[optind])) {
+		printf("%s: cannot open %s\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	if (argc - optind == 1) {
+		return self_test();
+	}
+
+	return write_image(argv[optind + 1]);
+}
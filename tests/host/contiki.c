@@ -0,0 +1,206 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+
+/*
+ * Host scheduler for the processes and etimers in contiki.h.
+ */
+
+#include <stdint.h>
+
+#include "contiki.h"
+
+#define QUEUE_SIZE 16
+
+struct event {
+	struct process *p;
+	process_event_t ev;
+	process_data_t data;
+};
+
+struct process *process_current;
+
+static struct process *processes;
+static struct etimer *etimers;
+static struct event queue[QUEUE_SIZE];
+static uint8_t queue_head;
+static uint8_t queue_count;
+static process_event_t last_event = PROCESS_EVENT_TIMER;
+
+static void call(struct process *p, process_event_t ev, process_data_t data) {
+	struct process *caller = process_current;
+
+	if (!p->running) {
+		return;
+	}
+
+	process_current = p;
+	if (p->thread(&p->pt, ev, data) >= PT_EXITED) {
+		struct process **pp;
+
+		// Take it off the list
+		p->running = 0;
+		for (pp = &processes; *pp; pp = &(*pp)->next) {
+			if (*pp == p) {
+				*pp = p->next;
+				break;
+			}
+		}
+	}
+	process_current = caller;
+}
+
+void process_start(struct process *p, process_data_t data) {
+	if (p->running) {
+		return;
+	}
+
+	p->next = processes;
+	processes = p;
+	p->running = 1;
+	p->needspoll = 0;
+	p->pt.lc = 0;
+
+	// Contiki runs the first part of the process straight away too
+	call(p, PROCESS_EVENT_INIT, data);
+}
+
+int process_post(struct process *p, process_event_t ev, process_data_t data) {
+	struct event *e;
+
+	if (queue_count == QUEUE_SIZE) {
+		return -1;
+	}
+
+	e = &queue[(queue_head + queue_count++) % QUEUE_SIZE];
+	e->p = p;
+	e->ev = ev;
+	e->data = data;
+
+	return 0;
+}
+
+void process_poll(struct process *p) {
+	if (p) {
+		p->needspoll = 1;
+	}
+}
+
+process_event_t process_alloc_event(void) {
+	return ++last_event;
+}
+
+int process_run(void) {
+	struct process *p;
+	struct etimer **etp;
+
+	// Post timer events for the etimers that have expired
+	for (etp = &etimers; *etp; ) {
+		struct etimer *et = *etp;
+
+		if (clock_time() - et->start >= et->interval) {
+			*etp = et->next;
+			process_post(et->p, PROCESS_EVENT_TIMER, et);
+			et->p = NULL;
+		}
+		else {
+			etp = &et->next;
+		}
+	}
+
+	// Polls go before events
+	for (p = processes; p; p = p->next) {
+		if (p->needspoll) {
+			p->needspoll = 0;
+			call(p, PROCESS_EVENT_POLL, NULL);
+		}
+	}
+
+	if (queue_count) {
+		struct event e = queue[queue_head];
+
+		queue_head = (queue_head + 1) % QUEUE_SIZE;
+		queue_count--;
+
+		if (e.p == PROCESS_BROADCAST) {
+			struct process *next;
+
+			for (p = processes; p; p = next) {
+				next = p->next;
+				call(p, e.ev, e.data);
+			}
+		}
+		else {
+			call(e.p, e.ev, e.data);
+		}
+	}
+
+	// Anything that was polled while that ran counts as queued
+	int count = queue_count;
+	for (p = processes; p; p = p->next) {
+		count += p->needspoll;
+	}
+
+	return count;
+}
+
+void etimer_set(struct etimer *et, clock_time_t interval) {
+	struct etimer *t;
+
+	et->start = clock_time();
+	et->interval = interval;
+	et->p = PROCESS_CURRENT();
+
+	for (t = etimers; t; t = t->next) {
+		if (t == et) {
+			return;
+		}
+	}
+	et->next = etimers;
+	etimers = et;
+}
+
+int etimer_expired(struct etimer *et) {
+	return et->p == NULL;
+}
+
+int etimer_pending(void) {
+	return etimers != NULL;
+}
+
+clock_time_t etimer_next_expiration_time(void) {
+	clock_time_t now = clock_time();
+	clock_time_t soonest = 0;
+	struct etimer *et;
+
+	for (et = etimers; et; et = et->next) {
+		clock_time_t elapsed = now - et->start;
+		clock_time_t left = 0;
+
+		if (elapsed < et->interval) {
+			left = et->interval - elapsed;
+		}
+		if (et == etimers || left < soonest) {
+			soonest = left;
+		}
+	}
+
+	return now + soonest;
+}
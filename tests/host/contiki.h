@@ -0,0 +1,146 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+
+/*
+ * Just enough of the Contiki process, protothread and etimer API to run
+ * library code such as lib/flashmgt.c on the host. Processes are
+ * scheduled by calling process_run() from main(), as on the board.
+ *
+ * The program linking this in provides clock_time(), so that timers can
+ * run on simulated time.
+ */
+
+#ifndef HOST_CONTIKI_H
+#define HOST_CONTIKI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <avr/io.h>
+
+#define CLOCK_SECOND 375 // as on PC_MB_001
+
+typedef unsigned long clock_time_t;
+typedef unsigned char process_event_t;
+typedef void *process_data_t;
+
+clock_time_t clock_time(void);
+
+/*
+ * Protothreads, with local continuations as switch cases
+ */
+
+struct pt {
+	unsigned short lc;
+};
+
+#define PT_WAITING 0
+#define PT_YIELDED 1
+#define PT_EXITED 2
+#define PT_ENDED 3
+
+/*
+ * Processes
+ */
+
+#define PROCESS_EVENT_NONE 0x80
+#define PROCESS_EVENT_INIT 0x81
+#define PROCESS_EVENT_POLL 0x82
+#define PROCESS_EVENT_EXIT 0x83
+#define PROCESS_EVENT_CONTINUE 0x85
+#define PROCESS_EVENT_TIMER 0x88
+
+#define PROCESS_BROADCAST NULL
+
+struct process {
+	struct process *next;
+	const char *name;
+	char (*thread)(struct pt *, process_event_t, process_data_t);
+	struct pt pt;
+	uint8_t running;
+	uint8_t needspoll;
+};
+
+#define PROCESS_NAME(name) extern struct process name
+
+#define PROCESS_THREAD(name, ev, data) \
+	static char process_thread_##name(struct pt *process_pt, \
+		process_event_t ev, process_data_t data)
+
+#define PROCESS(name, strname) \
+	PROCESS_THREAD(name, ev, data); \
+	struct process name = { NULL, strname, process_thread_##name, \
+		{ 0 }, 0, 0 }
+
+#define PROCESS_BEGIN() \
+	{ char process_yield = 1; (void)process_yield; \
+	switch (process_pt->lc) { case 0:
+
+#define PROCESS_END() \
+	} process_pt->lc = 0; return PT_ENDED; }
+
+#define PROCESS_WAIT_EVENT_UNTIL(c) \
+	do { \
+		process_yield = 0; \
+		process_pt->lc = __LINE__; __attribute__((fallthrough)); \
+		case __LINE__: \
+		if (!process_yield || !(c)) { \
+			return PT_YIELDED; \
+		} \
+	} while (0)
+
+#define PROCESS_WAIT_EVENT() PROCESS_WAIT_EVENT_UNTIL(1)
+#define PROCESS_YIELD() PROCESS_WAIT_EVENT_UNTIL(1)
+
+#define PROCESS_PAUSE() \
+	do { \
+		process_post(PROCESS_CURRENT(), PROCESS_EVENT_CONTINUE, NULL); \
+		PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_CONTINUE); \
+	} while (0)
+
+#define PROCESS_CURRENT() process_current
+
+extern struct process *process_current;
+
+void process_start(struct process *p, process_data_t data);
+int process_post(struct process *p, process_event_t ev, process_data_t data);
+void process_poll(struct process *p);
+process_event_t process_alloc_event(void);
+
+// Deliver polls and one event; returns how many events are still queued
+int process_run(void);
+
+/*
+ * Event timers
+ */
+
+struct etimer {
+	struct etimer *next;
+	struct process *p;
+	clock_time_t start;
+	clock_time_t interval;
+};
+
+void etimer_set(struct etimer *et, clock_time_t interval);
+int etimer_expired(struct etimer *et);
+int etimer_pending(void);
+clock_time_t etimer_next_expiration_time(void);
+
+#endif // HOST_CONTIKI_H
@@ -0,0 +1,111 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+
+/*
+ * The lib/settings.h API kept in memory, one value per key, for running
+ * library code on the host. Nothing survives the program exiting.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "settings.h"
+
+#define MAX_SETTINGS 16
+#define MAX_SIZE 64
+
+static struct {
+	settings_key_t key;
+	size_t size;
+	uint8_t value[MAX_SIZE];
+} settings[MAX_SETTINGS];
+
+static int find(settings_key_t key) {
+	for (int i = 0; i < MAX_SETTINGS; i++) {
+		if (settings[i].key == key) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+settings_status_t settings_get(settings_key_t key, uint8_t index,
+	void *value, size_t *value_size)
+{
+	int i = find(key);
+
+	if (i < 0 || index) {
+		return SETTINGS_STATUS_NOT_FOUND;
+	}
+
+	if (*value_size > settings[i].size) {
+		*value_size = settings[i].size;
+	}
+	memcpy(value, settings[i].value, *value_size);
+
+	return SETTINGS_STATUS_OK;
+}
+
+settings_status_t settings_add(settings_key_t key,
+	const void *value, size_t value_size)
+{
+	int i = find(SETTINGS_INVALID_KEY);
+
+	if (key == SETTINGS_INVALID_KEY) {
+		return SETTINGS_STATUS_FAILURE;
+	}
+	if (i < 0 || value_size > MAX_SIZE) {
+		return SETTINGS_STATUS_OUT_OF_SPACE;
+	}
+
+	settings[i].key = key;
+	settings[i].size = value_size;
+	memcpy(settings[i].value, value, value_size);
+
+	return SETTINGS_STATUS_OK;
+}
+
+bool settings_check(settings_key_t key, uint8_t index) {
+	return find(key) >= 0 && !index;
+}
+
+settings_status_t settings_set(settings_key_t key,
+	const void *value, size_t value_size)
+{
+	settings_delete(key, 0);
+	return settings_add(key, value, value_size);
+}
+
+settings_status_t settings_delete(settings_key_t key, uint8_t index) {
+	int i = find(key);
+
+	if (i < 0 || index || key == SETTINGS_INVALID_KEY) {
+		return SETTINGS_STATUS_NOT_FOUND;
+	}
+
+	settings[i].key = SETTINGS_INVALID_KEY;
+	return SETTINGS_STATUS_OK;
+}
+
+void settings_wipe(void) {
+	memset(settings, 0, sizeof(settings));
+}
@@ -0,0 +1,354 @@
+/*
+ * This file is part of the PolyController firmware source code.
+ * Copyright (C) 2011 Chris Boot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Host benchmark for polyfs and the polyfs CFS layer.
+ *
+ * The image is held in memory and every call to fn_read is counted. Each
+ * call is also charged a modelled cost for doing the same read from the
+ * dataflash over SPI, so changes can be compared on a plain Linux box.
+ *
+ * Build with something like:
+ *   gcc -std=gnu99 -O2 -I../include -I../lib <contiki native includes> \
+ *     -o polyfs-bench polyfs-bench.c ../lib/polyfs.c ../lib/polyfs_cfs.c
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "polyfs.h"
+#include "polyfs_cfs.h"
+
+/*
+ * Default cost model, based on dataflash_read_data() on PC_MB_001: the
+ * status register poll plus the opcode and three address bytes make six
+ * bytes of framing per read, and each byte costs about 2us at F_CPU/2
+ * once the spi_rw() polling overhead is included.
+ */
+#define DEFAULT_TXN_NS	15000
+#define DEFAULT_BYTE_NS	2000
+
+// Size of the reads done by the web trace (UIP_TCP_MSS on PC_MB_001)
+#define WEB_READ_SIZE	1226
+
+#define MAX_FILES	1024
+
+struct bench_stats {
+	unsigned long txns;
+	unsigned long long bytes;
+	unsigned long lookups;
+	unsigned long long payload;
+	double spi_ns;
+};
+
+polyfs_fs_t fs;
+
+static uint8_t *image;
+static size_t image_size;
+static unsigned long txn_ns = DEFAULT_TXN_NS;
+static unsigned long byte_ns = DEFAULT_BYTE_NS;
+static struct bench_stats stats;
+
+static char *files[MAX_FILES];
+static uint32_t sizes[MAX_FILES];
+static int nfiles;
+
+static int read_mem(polyfs_fs_t *fs, void *ptr,
+	uint32_t offset, uint32_t bytes)
+{
+	(void)fs;
+
+	if (offset >= image_size) {
+		return -1;
+	}
+	if (offset + bytes > image_size) {
+		bytes = image_size - offset;
+	}
+
+	memcpy(ptr, image + offset, bytes);
+
+	stats.txns++;
+	stats.bytes += bytes;
+	stats.spi_ns += txn_ns + (double)bytes * byte_ns;
+
+	return bytes;
+}
+
+static double now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int find_files(const struct polyfs_inode *inode, const char *path) {
+	polyfs_readdir_t rd;
+	char name[POLYFS_MAXPATHLEN + 1];
+	char *child;
+	int err;
+
+	err = polyfs_opendir(&fs, inode, &rd);
+	assert(err == 0);
+
+	while (rd.next) {
+		err = polyfs_readdir(&rd);
+		assert(err == 0);
+
+		name[0] = '\0';
+		strncat(name, (char *)rd.name, POLYFS_GET_NAMELEN(&rd.inode) << 2);
+
+		child = malloc(strlen(path) + strlen(name) + 2);
+		assert(child);
+		sprintf(child, "%s/%s", strcmp(path, "/") ? path : "", name);
+
+		if (S_ISDIR(POLYFS_16(rd.inode.mode))) {
+			struct polyfs_inode dir = rd.inode;
+			find_files(&dir, child);
+			free(child);
+		}
+		else if (S_ISREG(POLYFS_16(rd.inode.mode)) && nfiles < MAX_FILES) {
+			sizes[nfiles] = POLYFS_24(rd.inode.size);
+			files[nfiles++] = child;
+		}
+		else {
+			free(child);
+		}
+	}
+
+	return 0;
+}
+
+static int is_web_file(const char *path) {
+	static const char *exts[] = {
+		".html", ".shtml", ".htm", ".css", ".js", ".png", ".gif", ".ico",
+	};
+	const char *ext = strrchr(path, '.');
+
+	if (!ext) {
+		return 0;
+	}
+	for (unsigned int i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+		if (strcmp(ext, exts[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Read a whole file through the CFS layer, like shell-file.c does
+static void read_sequential(int idx) {
+	static uint8_t buf[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+	int fd, len;
+
+	fd = cfs_open(files[idx], CFS_READ);
+	assert(fd >= 0);
+	stats.lookups++;
+
+	// cfs_read() may return less than asked for (one block at a time), so
+	// keep going until it reports the end of the file
+	for (;;) {
+		len = cfs_read(fd, buf, sizeof(buf));
+		assert(len >= 0);
+		if (len == 0) {
+			break;
+		}
+		stats.payload += len;
+	}
+
+	cfs_close(fd);
+}
+
+// Read one block-aligned chunk from a random place in a random file
+static void read_random(int idx) {
+	static uint8_t buf[POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD];
+	uint32_t blocks = (sizes[idx] + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE;
+	int fd, len;
+
+	fd = cfs_open(files[idx], CFS_READ);
+	assert(fd >= 0);
+	stats.lookups++;
+
+	if (blocks > 1) {
+		cfs_seek(fd, (rand() % blocks) * POLYFS_BLOCK_SIZE, CFS_SEEK_SET);
+	}
+	len = cfs_read(fd, buf, sizeof(buf));
+	assert(len > 0);
+	stats.payload += len;
+
+	cfs_close(fd);
+}
+
+// Serve a file the way apps/webserver/sendfile.c does
+static void read_web(int idx) {
+	static uint8_t buf[WEB_READ_SIZE];
+	cfs_offset_t fpos = 0;
+	int fd, len;
+
+	fd = cfs_open(files[idx], CFS_READ);
+	assert(fd >= 0);
+	stats.lookups++;
+
+	while (fpos < cfs_seek(fd, 0, CFS_SEEK_END)) {
+		cfs_seek(fd, fpos, CFS_SEEK_SET);
+		len = cfs_read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+		stats.payload += len;
+		fpos += len;
+	}
+
+	cfs_close(fd);
+}
+
+static void run_trace(const char *name, void (*fn)(int), int web, int iterations) {
+	double start, elapsed;
+	int count = 0;
+
+	memset(&stats, 0, sizeof(stats));
+	start = now();
+
+	for (int i = 0; i < iterations; i++) {
+		for (int f = 0; f < nfiles; f++) {
+			int idx = (fn == read_random) ? rand() % nfiles : f;
+
+			if (web && !is_web_file(files[idx])) {
+				continue;
+			}
+			fn(idx);
+			count++;
+		}
+	}
+
+	elapsed = now() - start;
+	if (count == 0) {
+		printf("%-10s no files to read\n", name);
+		return;
+	}
+
+	printf("%-10s %7d %10.0f %10.0f %9lu %10llu %10.1f %8.1f\n",
+		name, count,
+		stats.lookups / elapsed,
+		stats.payload / 1024.0 / elapsed,
+		stats.txns, stats.bytes,
+		stats.spi_ns / 1e6,
+		stats.payload / 1024.0 / (stats.spi_ns / 1e9));
+}
+
+static int run_tests(const char *file, int iterations) {
+	int err;
+
+	// load the image into memory
+	FILE *fsbs = fopen(file, "r");
+	if (!fsbs) {
+		printf("failed to open file: %s\n", file);
+		return 1;
+	}
+	image = malloc(image_size);
+	assert(image);
+	err = fread(image, 1, image_size, fsbs);
+	assert((size_t)err == image_size);
+	fclose(fsbs);
+
+	// set up the structure
+	fs.userptr = NULL;
+	fs.fn_read = read_mem;
+	polyfs_cfs_fs = &fs;
+
+	// initialise
+	err = polyfs_init();
+	assert(err == 0);
+
+	// open the filesystem
+	err = polyfs_fs_open(&fs);
+	assert(err == 0);
+
+	find_files(&fs.root, "/");
+	if (nfiles == 0) {
+		printf("no files in filesystem\n");
+		return 1;
+	}
+
+	printf("%d files, %lu ns/transaction, %lu ns/byte, %d iterations\n",
+		nfiles, txn_ns, byte_ns, iterations);
+	printf("%-10s %7s %10s %10s %9s %10s %10s %8s\n",
+		"trace", "opens", "lookups/s", "host KiB/s",
+		"txns", "bytes", "spi ms", "spi KiB/s");
+
+	run_trace("sequential", read_sequential, 0, iterations);
+	run_trace("random", read_random, 0, iterations);
+	run_trace("web", read_web, 1, iterations);
+
+	free(image);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 10;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:n:s:t:")) != -1) {
+		switch (c) {
+		case 'b':
+			byte_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			srand(atoi(optarg));
+			break;
+		case 't':
+			txn_ns = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if (argc - optind != 1) {
+		printf("Usage: %s [-n iterations] [-s seed] [-t ns/transaction] "
+			"[-b ns/byte] <file.pfs>\n", argv[0]);
+		return 1;
+	}
+
+	struct stat s;
+	int err = stat(argv[optind], &s);
+	if (err) {
+		printf("%s: stat failed: %d\n", argv[0], errno);
+		return 1;
+	}
+
+	if (!S_ISREG(s.st_mode)) {
+		printf("%s: %s is not a regular file\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	image_size = s.st_size;
+	return run_tests(argv[optind], iterations);
+}
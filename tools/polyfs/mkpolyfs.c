@@ -46,6 +46,7 @@
 #include <assert.h>
 #include <getopt.h>
 #include <stdint.h>
+#include <limits.h>
 #include "polyfs/polyfs_fs.h"
 #include <zlib.h>
 #include <lzo/lzo1x.h>
@@ -194,9 +195,33 @@ static int opt_squash = 0;
 static int opt_lzo = 0;
 static int opt_zlib = 0;
 static char *opt_image = NULL;
+static int opt_image_lzo = 0;
 static char *opt_name = NULL;
+static unsigned long opt_window = 0;
+static char *opt_cache = NULL;
 static int swap_endian = 0;
 
+/*
+ * In streaming mode (opt_window != 0) the image is never held in memory
+ * as a whole.  Instead, all accesses go through image_ptr() which keeps a
+ * single window of the output file resident, writing it back and loading
+ * another part of the file as needed.  Input files are read a block at a
+ * time rather than being mapped.
+ */
+static struct {
+	int fd;
+	char *buf;
+	unsigned long start;
+	int valid;
+	int dirty;
+} window;
+
+/* Scratch buffer for input data in streaming mode */
+static char *input_buf = NULL;
+
+/* Compression cache statistics */
+static unsigned long cache_hits = 0, cache_misses = 0, cache_bytes = 0;
+
 static int warn_dev, warn_gid, warn_namelen, warn_skip, warn_size, warn_uid;
 static const char *const memory_exhausted = "memory exhausted";
 
@@ -229,6 +254,18 @@ extern int polyfs_lzo_cmpr(
 extern int polyfs_lzo_init(void);
 extern void polyfs_lzo_exit(void);
 
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buf[64];
+};
+
+static void sha256_init(struct sha256_ctx *ctx);
+static void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+static void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
+
 /* Input status of 0 to print help and exit without an error. */
 static void usage(int status)
 {
@@ -241,6 +278,7 @@ static void usage(int status)
 			"   -E         make all warnings errors (non-zero exit status)\n"
 			"   -e edition set edition number (part of fsid)\n"
 			"   -i file    insert a file image into the filesystem (requires >= 2.4.0)\n"
+			"   -c         compress the inserted image with LZO\n"
 			"   -n name    set name of polyfs filesystem\n"
 			"   -p         pad by %d bytes for boot code\n"
 			"   -s         sort directory entries (old option, ignored)\n"
@@ -251,6 +289,8 @@ static void usage(int status)
 			"   -l         create a filesystem for little-endian machines\n"
 			"   -L         create a filesystem using LZO compression\n"
 			"   -Z         create a filesystem using zlib compression\n"
+			"   -w kbytes  stream the image to outfile using a kbytes window of memory\n"
+			"   -C dir     cache compressed blocks in dir to speed up rebuilds\n"
 			" dirname    root of the filesystem to be created\n"
 			" outfile    output file\n", progname, PAD_SIZE);
 
@@ -402,9 +442,126 @@ extern char *xreadlink(const char *path)
 	return buf;
 }       
 
+static void window_flush(void)
+{
+	ssize_t written;
+
+	if (!window.valid || !window.dirty)
+		return;
+
+	written = pwrite(window.fd, window.buf, opt_window, window.start);
+	if (written < 0) {
+		perror_msg_and_die("write failed");
+	}
+	if ((unsigned long)written != opt_window) {
+		error_msg_and_die("ROM image write failed (wrote %zd of %lu bytes)",
+				written, opt_window);
+	}
+	window.dirty = 0;
+}
+
+static void window_load(unsigned long start)
+{
+	ssize_t got;
+
+	window_flush();
+
+	/* Anything past the end of the file so far reads back as zeroes */
+	memset(window.buf, 0x00, opt_window);
+	got = pread(window.fd, window.buf, opt_window, start);
+	if (got < 0) {
+		perror_msg_and_die("read failed");
+	}
+	window.start = start;
+	window.valid = 1;
+}
+
+/*
+ * Return a pointer to len bytes of the image at the given offset. The
+ * pointer is only valid until the next call to image_ptr().
+ */
+static char *image_ptr(char *base, unsigned long offset, unsigned long len)
+{
+	if (!opt_window)
+		return base + offset;
+
+	if (!window.valid || offset < window.start ||
+			offset + len > window.start + opt_window) {
+		if (len > opt_window - blksize)
+			error_msg_and_die("window too small for %lu bytes", len);
+		window_load(offset & ~(blksize - 1));
+	}
+
+	window.dirty = 1;
+	return window.buf + (offset - window.start);
+}
+
+/* Copy len bytes into the image, in window-sized chunks if necessary. */
+static void image_write(char *base, unsigned long offset, const void *src, unsigned long len)
+{
+	const char *p = src;
+
+	while (len) {
+		unsigned long chunk = len;
+		if (opt_window && chunk > opt_window / 2)
+			chunk = opt_window / 2;
+		memcpy(image_ptr(base, offset, chunk), p, chunk);
+		offset += chunk;
+		p += chunk;
+		len -= chunk;
+	}
+}
+
+/* CRC the streamed image between start and end by reading it back. */
+static uint32_t window_crc32(uint32_t crc, unsigned long start, unsigned long end)
+{
+	window_flush();
+	window.valid = 0;
+
+	while (start < end) {
+		unsigned long chunk = end - start;
+		ssize_t got;
+
+		if (chunk > opt_window)
+			chunk = opt_window;
+		memset(window.buf, 0x00, chunk);
+		got = pread(window.fd, window.buf, chunk, start);
+		if (got < 0) {
+			perror_msg_and_die("read failed");
+		}
+		crc = crc32(crc, (unsigned char *)window.buf, chunk);
+		start += chunk;
+	}
+
+	return crc;
+}
+
+/* Read part of an entry's data, from memory if we have it or the file. */
+static void read_entry(struct entry *entry, char *buf, unsigned long pos, unsigned int len)
+{
+	ssize_t got;
+
+	if (entry->uncompressed) {
+		memcpy(buf, (char *)entry->uncompressed + pos, len);
+		return;
+	}
+
+	got = pread(entry->fd, buf, len, pos);
+	if (got < 0 || (unsigned int)got != len) {
+		error_msg_and_die("read failed: %s", entry->path);
+	}
+}
+
 static void map_entry(struct entry *entry)
 {
-	if (entry->path) {
+	if (entry->path && opt_window) {
+		/* Streaming mode reads the file as we go instead */
+		entry->fd = open(entry->path, O_RDONLY);
+		if (entry->fd < 0) {
+			error_msg_and_die("open failed: %s", entry->path);
+		}
+	}
+	else if (entry->path) {
 		entry->fd = open(entry->path, O_RDONLY);
 		if (entry->fd < 0) {
 			error_msg_and_die("open failed: %s", entry->path);
@@ -418,7 +575,10 @@ static void map_entry(struct entry *entry)
 
 static void unmap_entry(struct entry *entry)
 {
-	if (entry->path) {
+	if (entry->path && opt_window) {
+		close(entry->fd);
+	}
+	else if (entry->path) {
 		if (munmap(entry->uncompressed, entry->size) < 0) {
 			error_msg_and_die("munmap failed: %s", entry->path);
 		}
@@ -427,6 +587,26 @@ static void unmap_entry(struct entry *entry)
 	}
 }
 
+/* Compare the contents of two equally-sized entries a block at a time. */
+static int compare_entries(struct entry *a, struct entry *b)
+{
+	char *buf = xmalloc(2 * blksize);
+	unsigned long pos;
+	int same = 1;
+
+	for (pos = 0; same && pos < a->size; pos += blksize) {
+		unsigned int len = a->size - pos;
+		if (len > blksize)
+			len = blksize;
+		read_entry(a, buf, pos, len);
+		read_entry(b, buf + blksize, pos, len);
+		same = !memcmp(buf, buf + blksize, len);
+	}
+
+	free(buf);
+	return same;
+}
+
 static int find_identical_file(struct entry *orig, struct entry *newfile)
 {
 	if (orig == newfile)
@@ -435,9 +615,15 @@ static int find_identical_file(struct entry *orig, struct entry *newfile)
 		return 0;
 	if (orig->size == newfile->size && (orig->path || orig->uncompressed))
 	{
+		int same;
+
 		map_entry(orig);
 		map_entry(newfile);
-		if (!memcmp(orig->uncompressed, newfile->uncompressed, orig->size))
+		if (opt_window)
+			same = compare_entries(orig, newfile);
+		else
+			same = !memcmp(orig->uncompressed, newfile->uncompressed, orig->size);
+		if (same)
 		{
 			newfile->same = orig;
 			unmap_entry(newfile);
@@ -682,6 +868,8 @@ static unsigned int write_superblock(struct entry *root, char *base, int size)
 		super->flags |= POLYFS_FLAG_HOLES;
 	if (image_length > 0)
 		super->flags |= POLYFS_FLAG_SHIFTED_ROOT_OFFSET;
+	if (image_length > 0 && opt_image_lzo)
+		super->flags |= POLYFS_FLAG_LZO_IMAGE;
 	if (opt_lzo)
 		super->flags |= POLYFS_FLAG_LZO_COMPRESSION;
 	else if (opt_zlib)
@@ -713,7 +901,8 @@ static unsigned int write_superblock(struct entry *root, char *base, int size)
 
 static void set_data_offset(struct entry *entry, char *base, unsigned long offset)
 {
-	struct polyfs_inode *inode = (struct polyfs_inode *) (base + entry->dir_offset);
+	struct polyfs_inode *inode = (struct polyfs_inode *)
+		image_ptr(base, entry->dir_offset, sizeof(struct polyfs_inode));
 
 	if ((offset & 3) != 0) {
 		error_msg_and_die("illegal offset of %lu bytes", offset);
@@ -773,8 +962,10 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 	for (;;) {
 		int dir_start = stack_entries;
 		while (entry) {
-			struct polyfs_inode *inode = (struct polyfs_inode *) (base + offset);
 			size_t len = strlen(entry->name);
+			struct polyfs_inode *inode = (struct polyfs_inode *)
+				image_ptr(base, offset, sizeof(struct polyfs_inode) + ((len + 3) & ~3));
+			char *name = (char *)(inode + 1);
 
 			entry->dir_offset = offset;
 
@@ -788,10 +979,10 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 
 			offset += sizeof(struct polyfs_inode);
 			total_nodes++;	/* another node */
-			memcpy(base + offset, entry->name, len);
+			memcpy(name, entry->name, len);
 			/* Pad up the name to a 4-byte boundary */
 			while (len & 3) {
-				*(base + offset + len) = '\0';
+				name[len] = '\0';
 				len++;
 			}
 			inode->namelen = len >> 2;
@@ -846,6 +1037,100 @@ static unsigned int write_directory_structure(struct entry *entry, char *base, u
 	return offset;
 }
 
+/*
+ * The compression cache stores the compressed form of each block in a
+ * file named after a SHA-256 of the uncompressed data. The codec, its
+ * library version and the block size are hashed in too, so that changing
+ * any of them can never give different output to a clean build.
+ */
+static void cache_key(const char *in, unsigned int input, char *key)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	const char *codec;
+	uint32_t tmp;
+	int i;
+
+	if (opt_lzo)
+		codec = lzo_version_string();
+	else
+		codec = zlibVersion();
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, opt_lzo ? "lzo" : "zlib", opt_lzo ? 4 : 5);
+	sha256_update(&ctx, codec, strlen(codec) + 1);
+	tmp = blksize;
+	sha256_update(&ctx, &tmp, sizeof(tmp));
+	tmp = input;
+	sha256_update(&ctx, &tmp, sizeof(tmp));
+	sha256_update(&ctx, in, input);
+	sha256_final(&ctx, digest);
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		*key++ = hex[digest[i] >> 4];
+		*key++ = hex[digest[i] & 0xf];
+		/* Spread the entries over 256 subdirectories */
+		if (i == 0)
+			*key++ = '/';
+	}
+	*key = '\0';
+}
+
+static int cache_fetch(const char *key, char *out, unsigned long *len)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	ssize_t got;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", opt_cache, key);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	/* Ignore anything that can't be a compressed block */
+	if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+			(unsigned long)st.st_size > *len) {
+		close(fd);
+		return 0;
+	}
+
+	got = read(fd, out, st.st_size);
+	close(fd);
+	if (got != st.st_size)
+		return 0;
+
+	*len = got;
+	return 1;
+}
+
+static void cache_store(const char *key, const char *data, unsigned long len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	ssize_t written;
+	int fd;
+
+	/* Create the subdirectory, ignoring errors as the open will fail */
+	snprintf(path, sizeof(path), "%s/%.2s", opt_cache, key);
+	mkdir(path, 0777);
+
+	/* Write to a temporary file first so a cache entry is never partial */
+	snprintf(path, sizeof(path), "%s/%s", opt_cache, key);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror_msg("%s", tmp);
+		return;
+	}
+	written = write(fd, data, len);
+	close(fd);
+	if (written < 0 || (unsigned long)written != len || rename(tmp, path) < 0) {
+		perror_msg("%s", path);
+		unlink(tmp);
+	}
+}
+
 static int is_zero(char const *begin, unsigned len)
 {
 	if (opt_holes)
@@ -881,46 +1166,81 @@ static unsigned int do_compress(char *base, unsigned int offset, struct entry *e
 	unsigned long blocks = (size - 1) / blksize + 1;
 	unsigned long curr = offset + 4 * blocks;
 	char *uncompressed = entry->uncompressed;
+	uint32_t *ptrs = xmalloc(4 * blocks);
+	unsigned long block = 0;
 
 	total_blocks += blocks; 
 
 	do {
 		unsigned long len = 2 * blksize;
 		unsigned int input = size;
+		char *in = uncompressed;
+		char *out;
 		if (input > blksize)
 			input = blksize;
+		if (!in) {
+			/* Streaming mode: fetch the block from the file */
+			in = input_buf;
+			read_entry(entry, in, entry->size - size, input);
+		}
 		size -= input;
-		if (!is_zero (uncompressed, input)) {
-			if (opt_zlib) {
-				compress((unsigned char *)(base + curr), &len,
-						(unsigned char *)uncompressed, input);
+		if (!is_zero (in, input)) {
+			char key[2 * SHA256_DIGEST_SIZE + 2];
+			int cached = 0;
+
+			out = image_ptr(base, curr, len);
+			if (opt_cache && (opt_zlib || opt_lzo)) {
+				cache_key(in, input, key);
+				cached = cache_fetch(key, out, &len);
+				if (cached) {
+					cache_hits++;
+					cache_bytes += input;
+				}
+				else {
+					cache_misses++;
+				}
+			}
+
+			if (cached) {
+				/* Reuse the block compressed by a previous run */
+			}
+			else if (opt_zlib) {
+				compress((unsigned char *)out, &len,
+						(unsigned char *)in, input);
 			}
 			else if (opt_lzo) {
 				int err = polyfs_lzo_cmpr(
-					(unsigned char *)uncompressed,
-					(unsigned char *)(base + curr), input,
+					(unsigned char *)in,
+					(unsigned char *)out, input,
 					(uint32_t *)&len);
 				if (err < 0)
 					error_msg_and_die("LZO compression error");
 			}
 			else { // no compression
-				memcpy(base + curr, uncompressed, input);
+				memcpy(out, in, input);
 				len = input;
 			}
+			if (opt_cache && (opt_zlib || opt_lzo) && !cached)
+				cache_store(key, out, len);
 			curr += len;
 		}
-		uncompressed += input;
+		if (uncompressed)
+			uncompressed += input;
 
 		if (len > blksize*2) {
 			/* (I don't think this can happen with zlib.) */
 			error_msg_and_die("AIEEE: block \"compressed\" to > 2*blocklength (%ld)\n", len);
 		}
 
-		*(uint32_t *) (base + offset) = curr;
-		if (swap_endian) fix_block_pointer((uint32_t*)(base + offset));
-		offset += 4;
+		ptrs[block] = curr;
+		if (swap_endian) fix_block_pointer(&ptrs[block]);
+		block++;
 	} while (size);
 
+	/* Fill in the block pointers now that we know where the blocks went */
+	image_write(base, offset, ptrs, 4 * blocks);
+	free(ptrs);
+
 	curr = (curr + 3) & ~3;
 
 	return curr;
@@ -937,11 +1257,9 @@ static unsigned int write_data(struct entry *entry, char *base, unsigned int off
 	do {
 		if (entry->path || entry->uncompressed) {
 			if (entry->same) {
-				set_data_offset(entry, base, entry->same->offset);
 				entry->offset = entry->same->offset;
 			}
 			else {
-				set_data_offset(entry, base, offset);
 				entry->offset = offset;
 				map_entry(entry);
 				offset = do_compress(base, offset, entry);
@@ -955,12 +1273,51 @@ static unsigned int write_data(struct entry *entry, char *base, unsigned int off
 	return offset;
 }
 
+/*
+ * Point the directory entries of everything written by write_data() at
+ * their data. This is done as a separate pass so that the directory is
+ * visited in order rather than once per file.
+ */
+static void set_data_offsets(struct entry *entry, char *base)
+{
+	do {
+		if (entry->path || entry->uncompressed)
+			set_data_offset(entry, base, entry->offset);
+		else if (entry->child)
+			set_data_offsets(entry->child, base);
+		entry = entry->next;
+	} while (entry);
+}
+
 static unsigned int write_file(char *file, char *base, unsigned int offset)
 {
 	int fd;
 	char *buf;
 
 	fd = xopen(file, O_RDONLY, 0);
+	if (opt_window) {
+		unsigned long pos = 0;
+
+		/* Copy the image across a window at a time */
+		while (pos < (unsigned long)image_length) {
+			unsigned long chunk = image_length - pos;
+			ssize_t got;
+
+			if (chunk > opt_window / 2)
+				chunk = opt_window / 2;
+			got = read(fd, input_buf, chunk);
+			if (got <= 0)
+				perror_msg_and_die("%s", file);
+			image_write(base, offset + pos, input_buf, got);
+			pos += got;
+		}
+		close(fd);
+		while (image_length & 3) {
+			*image_ptr(base, offset + image_length, 1) = '\0';
+			image_length++;
+		}
+		return (offset + image_length);
+	}
 	buf = mmap(NULL, image_length, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (buf == MAP_FAILED) {
 		error_msg_and_die("mmap failed");
@@ -976,6 +1333,49 @@ static unsigned int write_file(char *file, char *base, unsigned int offset)
 	return (offset + image_length);
 }
 
+/*
+ * Write the image as its uncompressed length followed by LZO blocks laid
+ * out just like a compressed file, so the bootloader can decompress it a
+ * block at a time.
+ */
+static unsigned int write_compressed_file(char *file, char *base, unsigned int offset)
+{
+	struct entry entry;
+	uint32_t length = image_length;
+	unsigned int end;
+	int save_lzo = opt_lzo, save_zlib = opt_zlib;
+	long save_blocks = total_blocks;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = file;
+	entry.size = image_length;
+	map_entry(&entry);
+
+	if (swap_endian)
+		length = wswap(length);
+	image_write(base, offset, &length, 4);
+
+	/* The image is always LZO compressed, whatever the files are */
+	opt_lzo = 1;
+	opt_zlib = 0;
+	end = do_compress(base, offset + 4, &entry);
+	opt_lzo = save_lzo;
+	opt_zlib = save_zlib;
+
+	/* The image blocks don't count towards the filesystem's */
+	total_blocks = save_blocks;
+
+	unmap_entry(&entry);
+
+	if (opt_verbose)
+		printf("Image: %u bytes compressed to %u\n",
+			image_length, end - offset);
+
+	/* The root directory goes after the compressed data */
+	image_length = end - offset;
+	return end;
+}
+
 static struct entry *find_filesystem_entry(struct entry *dir, char *name, mode_t type)
 {
 	struct entry *e = dir;
@@ -1297,7 +1697,7 @@ int main(int argc, char **argv)
 		progname = argv[0];
 
 	/* command line options */
-	while ((c = getopt(argc, argv, "bD:Ee:hi:ln:pqrsvVzLZ")) != EOF) {
+	while ((c = getopt(argc, argv, "bcC:D:Ee:hi:ln:pqrsvVw:zLZ")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(MKFS_OK);
@@ -1321,6 +1721,9 @@ int main(int argc, char **argv)
 				image_length = st.st_size; /* may be padded later */
 				fslen_ub += (image_length + 3); /* 3 is for padding */
 				break;
+			case 'c':
+				opt_image_lzo = 1;
+				break;
 			case 'n':
 				opt_name = optarg;
 				break;
@@ -1334,12 +1737,24 @@ int main(int argc, char **argv)
 			case 'v':
 				opt_verbose++;
 				break;
+			case 'w':
+				errno = 0;
+				opt_window = strtoul(optarg, &ep, 10) << 10;
+				if (errno || optarg[0] == '\0' || *ep != '\0')
+					usage(MKFS_USAGE);
+				if (opt_window < 2 * blksize)
+					error_msg_and_die("-w needs a window of at least %u kbytes",
+							(2 * blksize) >> 10);
+				break;
 			case 'z':
 				opt_holes = 1;
 				break;
 			case 'q':
 				opt_squash = 1;
 				break;
+			case 'C':
+				opt_cache = optarg;
+				break;
 			case 'D':
 				devtable = xfopen(optarg, "r");
 				if (fstat(fileno(devtable), &st) < 0)
@@ -1374,6 +1789,24 @@ int main(int argc, char **argv)
 	if (opt_zlib && opt_lzo)
 		error_msg_and_die("Cannot use both LZO and zlib!");
 
+	if (opt_image_lzo) {
+		unsigned long blocks = (image_length + blksize - 1) / blksize;
+
+		if (!opt_image)
+			error_msg_and_die("-c needs an image to compress (-i)");
+
+		/* Length, block pointers and LZO's worst case expansion */
+		fslen_ub += 4 + blocks * (4 + blksize / 16 + 64 + 3);
+	}
+
+	if (opt_cache && !opt_zlib && !opt_lzo)
+		error_msg_and_die("-C only caches compressed blocks; use it with -L or -Z");
+
+	if (opt_cache) {
+		if (mkdir(opt_cache, 0777) < 0 && errno != EEXIST)
+			perror_msg_and_die("%s", opt_cache);
+	}
+
 	if ((argc - optind) != 2)
 		usage(MKFS_USAGE);
 	dirname = argv[optind];
@@ -1382,7 +1815,7 @@ int main(int argc, char **argv)
 	if (opt_verbose && swap_endian)
 		printf("Swapping filesystem endian-ness\n");
 
-	if (opt_lzo) {
+	if (opt_lzo || opt_image_lzo) {
 		if (polyfs_lzo_init() < 0)
 			error_msg_and_die("polyfs_lzo_init failed");
 	}
@@ -1390,7 +1823,16 @@ int main(int argc, char **argv)
 	if (stat(dirname, &st) < 0) {
 		error_msg_and_die("stat failed: %s", dirname);
 	}
-	fd = xopen(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (opt_window) {
+		/* Round up, and leave room for a block either side of a
+		   compressed block straddling the window */
+		opt_window = ((opt_window - 1) | (blksize - 1)) + 1;
+		if (opt_window < 4 * blksize)
+			opt_window = 4 * blksize;
+		if (opt_verbose)
+			printf("Streaming with a %lu kilobyte window\n", opt_window >> 10);
+	}
+	fd = xopen(outfile, (opt_window ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0666);
 
 	root_entry = xcalloc(1, sizeof(struct entry));
 	root_entry->mode = st.st_mode;
@@ -1428,15 +1870,25 @@ int main(int argc, char **argv)
 	   RAM free.  If the reason is to be able to write to
 	   un-mmappable block devices, then we could try shared mmap
 	   and revert to anonymous mmap if the shared mmap fails. */
-	rom_image = mmap(NULL, fslen_ub?fslen_ub:1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (opt_window) {
+		/* Only the window and one input buffer are kept in memory */
+		rom_image = NULL;
+		window.fd = fd;
+		window.buf = xmalloc(opt_window);
+		input_buf = xmalloc(opt_window / 2);
+	}
+	else {
+		rom_image = mmap(NULL, fslen_ub?fslen_ub:1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	if (rom_image == MAP_FAILED) {
-		error_msg_and_die("mmap failed");
+		if (rom_image == MAP_FAILED) {
+			error_msg_and_die("mmap failed");
+		}
 	}
 
 	/* Skip the first opt_pad bytes for boot loader code */
 	offset = opt_pad;
-	memset(rom_image, 0x00, opt_pad);
+	if (opt_pad)
+		memset(image_ptr(rom_image, 0, opt_pad), 0x00, opt_pad);
 
 	/* Skip the superblock and come back to write it later. */
 	offset += sizeof(struct polyfs_super);
@@ -1444,7 +1896,10 @@ int main(int argc, char **argv)
 	/* Insert a file image. */
 	if (opt_image) {
 		printf("Including: %s\n", opt_image);
-		offset = write_file(opt_image, rom_image, offset);
+		if (opt_image_lzo)
+			offset = write_compressed_file(opt_image, rom_image, offset);
+		else
+			offset = write_file(opt_image, rom_image, offset);
 	}
 
 	offset = write_directory_structure(root_entry->child, rom_image, offset);
@@ -1452,6 +1907,7 @@ int main(int argc, char **argv)
 		printf("Directory data: %ld bytes\n", (long)offset);
 
 	offset = write_data(root_entry, rom_image, offset);
+	set_data_offsets(root_entry, rom_image);
 
 	/* We always write a multiple of blksize bytes, so that
 	   losetup works. */
@@ -1460,32 +1916,55 @@ int main(int argc, char **argv)
 		printf("Everything: %ld kilobytes\n", (long)offset >> 10);
 
 	/* Write the superblock now that we can fill in all of the fields. */
-	write_superblock(root_entry, rom_image+opt_pad, offset);
+	write_superblock(root_entry,
+			image_ptr(rom_image, opt_pad, sizeof(struct polyfs_super)), offset);
 	if (opt_verbose)
 		printf("Super block: %lu bytes\n", (unsigned long)sizeof(struct polyfs_super));
 
 	/* Put the checksum in. */
 	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, (unsigned char *)(rom_image+opt_pad), (offset-opt_pad));
+	if (opt_window)
+		crc = window_crc32(crc, opt_pad, offset);
+	else
+		crc = crc32(crc, (unsigned char *)(rom_image+opt_pad), (offset-opt_pad));
 	if (swap_endian)
 		crc = wswap(crc);
-	((struct polyfs_super *) (rom_image+opt_pad))->fsid.crc = crc;
+	((struct polyfs_super *) image_ptr(rom_image, opt_pad,
+		sizeof(struct polyfs_super)))->fsid.crc = crc;
 	if (opt_verbose)
 		printf("CRC: %x\n", crc);
 
-	/* Check to make sure we allocated enough space. */
-	if (fslen_ub < offset) {
-		error_msg_and_die("not enough space allocated for ROM "
-				"image (%Ld allocated, %d used)", fslen_ub, offset);
+	if (opt_window) {
+		/* The last window may have run past the end of the image */
+		window_flush();
+		if (ftruncate(fd, offset) < 0) {
+			perror_msg_and_die("%s", outfile);
+		}
+		free(window.buf);
+		free(input_buf);
 	}
+	else {
+		/* Check to make sure we allocated enough space. */
+		if (fslen_ub < offset) {
+			error_msg_and_die("not enough space allocated for ROM "
+					"image (%Ld allocated, %d used)", fslen_ub, offset);
+		}
 
-	written = write(fd, rom_image, offset);
-	if (written < 0) {
-		error_msg_and_die("write failed");
+		written = write(fd, rom_image, offset);
+		if (written < 0) {
+			error_msg_and_die("write failed");
+		}
+		if (offset != written) {
+			error_msg_and_die("ROM image write failed (wrote %d of %d bytes)", written, offset);
+		}
 	}
-	if (offset != written) {
-		error_msg_and_die("ROM image write failed (wrote %d of %d bytes)", written, offset);
+	if (opt_cache && (cache_hits || cache_misses)) {
+		printf("Compression cache: %lu hits, %lu misses (%lu%%), %lu kilobytes reused\n",
+				cache_hits, cache_misses,
+				cache_hits * 100 / (cache_hits + cache_misses),
+				cache_bytes >> 10);
 	}
+
 	/* Free up memory */
 	free_filesystem_entry(root_entry);
 	free(root_entry);
@@ -1519,7 +1998,7 @@ int main(int argc, char **argv)
 			(warn_namelen||warn_skip||warn_size||warn_uid||warn_gid||warn_dev))
 		exit(MKFS_ERROR);
 
-	if (opt_lzo)
+	if (opt_lzo || opt_image_lzo)
 		polyfs_lzo_exit();
 
 	exit(MKFS_OK);
@@ -1589,3 +2068,109 @@ void polyfs_lzo_exit(void) {
 	free(lzo_mem);
 }
 
+
+/*
+ * Minimal SHA-256 (FIPS 180-4) for naming compression cache entries.
+ */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(uint32_t *state, const unsigned char *block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+			((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for (; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+			(ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->count = 0;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t fill = ctx->count & 63;
+
+	ctx->count += len;
+
+	while (len) {
+		size_t chunk = 64 - fill;
+		if (chunk > len)
+			chunk = len;
+		memcpy(ctx->buf + fill, p, chunk);
+		fill += chunk;
+		p += chunk;
+		len -= chunk;
+
+		if (fill == 64) {
+			sha256_transform(ctx->state, ctx->buf);
+			fill = 0;
+		}
+	}
+}
+
+static void sha256_final(struct sha256_ctx *ctx, unsigned char *digest)
+{
+	uint64_t bits = ctx->count << 3;
+	unsigned char pad[72];
+	size_t padlen = 64 - (ctx->count & 63);
+	int i;
+
+	/* Always room for the 0x80 byte and the 8-byte length */
+	if (padlen < 9)
+		padlen += 64;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[padlen - 1 - i] = bits >> (i * 8);
+	sha256_update(ctx, pad, padlen);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
@@ -51,6 +51,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 #ifndef __APPLE__
 #include <sys/sysmacros.h>
 #endif
@@ -106,6 +108,41 @@ static unsigned long read_buffer_block = ~0UL;
 static char outbuffer[POLYFS_BLOCK_SIZE * 2];
 static z_stream stream;
 
+/*
+ * Fast mode (-f): the image is mapped into memory, the CRC is taken using
+ * a slice-by-8 table, and the blocks of every file are decompressed and
+ * checked by a pool of threads once the directory tree has been walked.
+ */
+static int opt_fast = 0;		/* fast parallel mode (-f) */
+static int opt_threads = 0;		/* number of threads (-j) */
+static char *opt_report = NULL;	/* report file (-r) */
+static char *image = NULL;		/* mapped image in fast mode */
+static size_t image_length = 0;
+static uint32_t image_crc;		/* CRC computed in fast mode */
+
+/* Outcome of checking a single data block */
+struct block_result {
+	unsigned long start, end;	/* compressed data */
+	unsigned long out;		/* bytes after decompression */
+	char *error;			/* NULL if the block is fine */
+	int checked;			/* 0 if an earlier block stopped the check */
+};
+
+/* A file or symlink queued for checking in fast mode */
+struct fsck_job {
+	char *path;
+	struct polyfs_inode inode;
+	unsigned long offset;		/* block pointer table */
+	unsigned long blocks;
+	unsigned long end;		/* end of the file's data */
+	int errors;
+	struct block_result *results;
+};
+
+static struct fsck_job *jobs = NULL;
+static unsigned long job_count = 0, job_alloc = 0, job_next = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Prototypes */
 static void expand_fs(char *, struct polyfs_inode *);
 #endif /* INCLUDE_FS_TESTS */
@@ -115,10 +152,13 @@ static void usage(int status)
 {
 	FILE *stream = status ? stderr : stdout;
 
-	fprintf(stream, "usage: %s [-hv] [-x dir] file\n"
+	fprintf(stream, "usage: %s [-hfv] [-j threads] [-r report] [-x dir] file\n"
 			" -h         print this help\n"
 			" -x dir     extract into dir\n"
 			" -v         be more verbose\n"
+			" -f         fast mode: check all blocks in parallel\n"
+			" -j threads number of threads to use in fast mode\n"
+			" -r report  write a per-file and per-block report (- for stdout)\n"
 			" file       file to test\n", progname);
 
 	exit(status);
@@ -286,6 +326,75 @@ static void test_crc(int start)
 }
 
 #ifdef INCLUDE_FS_TESTS
+/*
+ * Slice-by-8 CRC32, using the same polynomial and conventions as zlib's
+ * crc32() so the result can be compared directly with the superblock.
+ */
+static uint32_t crc_table[8][256];
+
+static void crc_init_tables(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		c = crc_table[0][i];
+		for (j = 1; j < 8; j++) {
+			c = crc_table[0][c & 0xff] ^ (c >> 8);
+			crc_table[j][i] = c;
+		}
+	}
+}
+
+static uint32_t crc32_sliced(uint32_t crc, const unsigned char *p, size_t len)
+{
+	crc = ~crc;
+
+	while (len >= 8) {
+		uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+			crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+			crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/* Map the whole image and check its CRC, treating fsid.crc as zero. */
+static void test_crc_fast(int start, size_t length)
+{
+	static const unsigned char zero[4];
+	size_t crc_pos = start + offsetof(struct polyfs_super, fsid.crc);
+
+	image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED) {
+		die(FSCK_ERROR, 1, "mmap failed: %s", filename);
+	}
+	image_length = length;
+
+	if (!(super.flags & POLYFS_FLAG_FSID_VERSION_1))
+		return;
+
+	crc_init_tables();
+	image_crc = crc32_sliced(0, (unsigned char *)image + start, crc_pos - start);
+	image_crc = crc32_sliced(image_crc, zero, sizeof(zero));
+	image_crc = crc32_sliced(image_crc, (unsigned char *)image + crc_pos + 4,
+			super.size - crc_pos - 4);
+}
+
 static void print_node(char type, struct polyfs_inode *i, char *name)
 {
 	char info[11];
@@ -309,6 +418,12 @@ static void print_node(char type, struct polyfs_inode *i, char *name)
 static void *romfs_read(unsigned long offset)
 {
 	unsigned int block = offset >> ROMBUFFER_BITS;
+	if (image) {
+		if (offset >= image_length) {
+			die(FSCK_UNCORRECTED, 0, "offset %lu past end of image", offset);
+		}
+		return image + offset;
+	}
 	if (block != read_buffer_block) {
 		read_buffer_block = block;
 		lseek(fd, block << ROMBUFFER_BITS, SEEK_SET);
@@ -347,7 +462,13 @@ static void iput(struct polyfs_inode *inode)
 	free(inode);
 }
 
-static int uncompress_block(void *src, int len)
+/*
+ * Decompress one block into outbuf. Returns the decompressed length, or
+ * -1 with a description of the problem in msg. This must not touch any
+ * global state as it is called from several threads in fast mode.
+ */
+static int decompress_block(z_stream *strm, char *outbuf, void *src, int len,
+		char *msg, size_t msglen)
 {
 	int err;
 
@@ -355,18 +476,19 @@ static int uncompress_block(void *src, int len)
 		lzo_uint outlen = POLYFS_BLOCK_SIZE*2;
 
 		if (len > POLYFS_BLOCK_SIZE + (POLYFS_BLOCK_SIZE / 16) + 64 + 3) {
-			die(FSCK_UNCORRECTED, 0, "data block too large");
+			snprintf(msg, msglen, "data block too large");
+			return -1;
 		}
 
-		err = lzo1x_decompress_safe(src, len, (unsigned char *)outbuffer, &outlen, NULL);
+		err = lzo1x_decompress_safe(src, len, (unsigned char *)outbuf, &outlen, NULL);
 		if (err != LZO_E_OK) {
-			die(FSCK_UNCORRECTED, 0, "decompression error %d",
-				err);
+			snprintf(msg, msglen, "decompression error %d", err);
+			return -1;
 		}
 
 		// take a CRC of the decompressed data
 		uint32_t crc = crc32(0L, Z_NULL, 0);
-		crc = crc32(crc, (Bytef *)outbuffer, outlen);
+		crc = crc32(crc, (Bytef *)outbuf, outlen);
 
 		// now try to do an overlapping decompression
 		unsigned char *overlap = calloc(1, POLYFS_BLOCK_MAX_SIZE_WITH_OVERHEAD);
@@ -377,45 +499,63 @@ static int uncompress_block(void *src, int len)
 		err = lzo1x_decompress_safe(overlap + offset, len, overlap, &new_len, NULL);
 		if (err != LZO_E_OK) {
 			free(overlap);
-			die(FSCK_UNCORRECTED, 0, "LZO overlap decompression failed: %d (1)", err);
+			snprintf(msg, msglen, "LZO overlap decompression failed: %d (1)", err);
+			return -1;
 		}
 		uint32_t crc2 = crc32(0L, Z_NULL, 0);
 		crc2 = crc32(crc2, overlap, new_len);
 		if (new_len != outlen || crc != crc2) {
 			free(overlap);
-			die(FSCK_UNCORRECTED, 0, "LZO overlap decompression failed: %d (2)", err);
+			snprintf(msg, msglen, "LZO overlap decompression failed: %d (2)", err);
+			return -1;
 		}
 		free(overlap);
 
 		return outlen;
 	}
 	else if (super.flags & POLYFS_FLAG_ZLIB_COMPRESSION) {
-		stream.next_in = src;
-		stream.avail_in = len;
+		strm->next_in = src;
+		strm->avail_in = len;
 	
-		stream.next_out = (unsigned char *) outbuffer;
-		stream.avail_out = POLYFS_BLOCK_SIZE*2;
+		strm->next_out = (unsigned char *) outbuf;
+		strm->avail_out = POLYFS_BLOCK_SIZE*2;
 	
-		inflateReset(&stream);
+		inflateReset(strm);
 	
 		if (len > POLYFS_BLOCK_SIZE*2) {
-			die(FSCK_UNCORRECTED, 0, "data block too large");
+			snprintf(msg, msglen, "data block too large");
+			return -1;
 		}
-		err = inflate(&stream, Z_FINISH);
+		err = inflate(strm, Z_FINISH);
 		if (err != Z_STREAM_END) {
-			die(FSCK_UNCORRECTED, 0, "decompression error %p(%d): %s",
+			snprintf(msg, msglen, "decompression error %p(%d): %s",
 					src, len, zError(err));
+			return -1;
 		}
-		return stream.total_out;
+		return strm->total_out;
 	}
 	else {
-		if (len > POLYFS_BLOCK_SIZE)
-			die(FSCK_UNCORRECTED, 0, "data block too large");
+		if (len > POLYFS_BLOCK_SIZE) {
+			snprintf(msg, msglen, "data block too large");
+			return -1;
+		}
 
 		return len;
 	}
 }
 
+static int uncompress_block(void *src, int len)
+{
+	char msg[128];
+	int out;
+
+	out = decompress_block(&stream, outbuffer, src, len, msg, sizeof(msg));
+	if (out < 0) {
+		die(FSCK_UNCORRECTED, 0, "%s", msg);
+	}
+	return out;
+}
+
 static void do_uncompress(char *path, int fd, unsigned long offset, unsigned long size)
 {
 	unsigned long curr = offset + 4 * ((size + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE);
@@ -462,6 +602,255 @@ static void do_uncompress(char *path, int fd, unsigned long offset, unsigned lon
 	} while (size);
 }
 
+/* Queue a file or symlink to have its blocks checked in fast mode. */
+static void queue_job(char *path, struct polyfs_inode *i, unsigned long blocks)
+{
+	struct fsck_job *job;
+
+	if (job_count == job_alloc) {
+		job_alloc = job_alloc ? job_alloc * 2 : 256;
+		jobs = realloc(jobs, job_alloc * sizeof(*jobs));
+		if (!jobs) {
+			die(FSCK_ERROR, 1, "realloc failed");
+		}
+	}
+
+	job = &jobs[job_count++];
+	memset(job, 0, sizeof(*job));
+	job->path = strdup(path);
+	job->inode = *i;
+	job->offset = i->offset << 2;
+	job->blocks = blocks;
+	job->results = calloc(blocks, sizeof(struct block_result));
+	if (!job->path || !job->results) {
+		die(FSCK_ERROR, 1, "malloc failed");
+	}
+}
+
+static void block_error(struct fsck_job *job, struct block_result *r, const char *fmt, ...)
+{
+	va_list arg_ptr;
+	char msg[128];
+
+	va_start(arg_ptr, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, arg_ptr);
+	va_end(arg_ptr);
+
+	r->error = strdup(msg);
+	job->errors++;
+}
+
+/*
+ * Check every block of a file: the block pointers must increase and stay
+ * inside the image, and each block must decompress to exactly the size
+ * implied by the inode.
+ */
+static void check_job(struct fsck_job *job, z_stream *strm, char *outbuf)
+{
+	unsigned long size = job->inode.size;
+	unsigned long curr = job->offset + 4 * job->blocks;
+	unsigned long b;
+	char msg[128];
+
+	job->end = curr;
+	if (curr > super.size) {
+		block_error(job, &job->results[0], "block pointers past end of filesystem");
+		return;
+	}
+
+	for (b = 0; b < job->blocks; b++) {
+		struct block_result *r = &job->results[b];
+		unsigned long next = POLYFS_32(*(uint32_t *) (image + job->offset + 4 * b));
+		unsigned long expect = size < POLYFS_BLOCK_SIZE ? size : POLYFS_BLOCK_SIZE;
+		int out;
+
+		/* Symlinks are stored as a single block of any length */
+		if (S_ISLNK(job->inode.mode))
+			expect = size;
+
+		r->checked = 1;
+		r->start = curr;
+		r->end = next;
+
+		if (next < curr) {
+			block_error(job, r, "block pointer not monotonic");
+			break;
+		}
+		if (next > super.size) {
+			block_error(job, r, "block pointer past end of filesystem");
+			break;
+		}
+
+		if (next == curr) {
+			/* A hole */
+			out = expect;
+		}
+		else {
+			out = decompress_block(strm, outbuf, image + curr, next - curr,
+					msg, sizeof(msg));
+			if (out < 0) {
+				block_error(job, r, "%s", msg);
+				out = 0;
+			}
+			else if ((unsigned long)out != expect) {
+				block_error(job, r, "decompressed to %d bytes, expected %lu",
+						out, expect);
+			}
+		}
+
+		r->out = out;
+		size -= expect;
+		curr = next;
+	}
+
+	job->end = curr;
+}
+
+static void *check_thread(void *arg)
+{
+	z_stream strm;
+	char *outbuf = malloc(POLYFS_BLOCK_SIZE * 2);
+
+	(void)arg;
+	if (!outbuf) {
+		die(FSCK_ERROR, 1, "malloc failed");
+	}
+	memset(&strm, 0, sizeof(strm));
+	inflateInit(&strm);
+
+	for (;;) {
+		unsigned long n;
+
+		pthread_mutex_lock(&job_lock);
+		n = job_next++;
+		pthread_mutex_unlock(&job_lock);
+
+		if (n >= job_count)
+			break;
+		check_job(&jobs[n], &strm, outbuf);
+	}
+
+	inflateEnd(&strm);
+	free(outbuf);
+	return NULL;
+}
+
+/*
+ * The report is tab-separated, one record per line:
+ *   image <file> <size> <crc> ok|crc-error
+ *   file <path> <offset> <size> <blocks> ok|error
+ *   block <path> <index> <start> <end> <out> ok|not-checked|<error message>
+ *   summary <files> <blocks> <bad files> <bad blocks>
+ *
+ * Blocks after a bad block pointer can't be located, so they are reported
+ * as not-checked rather than ok.
+ */
+static void write_report(FILE *out, unsigned long bad_files, unsigned long bad_blocks)
+{
+	unsigned long n, b, total = 0;
+
+	fprintf(out, "image\t%s\t%u\t%08x\t%s\n", filename, super.size,
+			super.fsid.crc, image_crc == super.fsid.crc ? "ok" : "crc-error");
+
+	for (n = 0; n < job_count; n++) {
+		struct fsck_job *job = &jobs[n];
+
+		fprintf(out, "file\t%s\t%lu\t%u\t%lu\t%s\n", job->path,
+				job->offset, job->inode.size, job->blocks,
+				job->errors ? "error" : "ok");
+		for (b = 0; b < job->blocks; b++) {
+			struct block_result *r = &job->results[b];
+
+			fprintf(out, "block\t%s\t%lu\t%lu\t%lu\t%lu\t%s\n", job->path,
+					b, r->start, r->end, r->out,
+					r->error ? r->error : r->checked ? "ok" : "not-checked");
+		}
+		total += job->blocks;
+	}
+
+	fprintf(out, "summary\t%lu\t%lu\t%lu\t%lu\n",
+			job_count, total, bad_files, bad_blocks);
+}
+
+/* Check all the queued files in parallel, then report on the results. */
+static void run_jobs(void)
+{
+	pthread_t *threads;
+	unsigned long n, b, bad_files = 0, bad_blocks = 0;
+	int t;
+
+	if (opt_threads <= 0)
+		opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opt_threads <= 0)
+		opt_threads = 1;
+	if (opt_verbose)
+		printf("Checking %lu files using %d threads\n", job_count, opt_threads);
+
+	threads = calloc(opt_threads, sizeof(pthread_t));
+	if (!threads) {
+		die(FSCK_ERROR, 1, "malloc failed");
+	}
+	for (t = 0; t < opt_threads; t++) {
+		if (pthread_create(&threads[t], NULL, check_thread, NULL)) {
+			die(FSCK_ERROR, 1, "pthread_create failed");
+		}
+	}
+	for (t = 0; t < opt_threads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+
+	for (n = 0; n < job_count; n++) {
+		struct fsck_job *job = &jobs[n];
+
+		if (job->end > end_data) {
+			end_data = job->end;
+		}
+		if (job->errors) {
+			bad_files++;
+		}
+		for (b = 0; b < job->blocks; b++) {
+			if (job->results[b].error)
+				bad_blocks++;
+		}
+	}
+
+	if (opt_report) {
+		FILE *out = stdout;
+
+		if (strcmp(opt_report, "-") != 0) {
+			out = fopen(opt_report, "w");
+			if (!out) {
+				die(FSCK_ERROR, 1, "open failed: %s", opt_report);
+			}
+		}
+		write_report(out, bad_files, bad_blocks);
+		if (out != stdout)
+			fclose(out);
+	}
+
+	for (n = 0; n < job_count; n++) {
+		for (b = 0; b < jobs[n].blocks; b++) {
+			struct block_result *r = &jobs[n].results[b];
+
+			if (r->error && !opt_report) {
+				fprintf(stderr, "%s: block %lu: %s\n", jobs[n].path, b, r->error);
+			}
+			free(r->error);
+		}
+		free(jobs[n].results);
+		free(jobs[n].path);
+	}
+	free(jobs);
+
+	if (super.flags & POLYFS_FLAG_FSID_VERSION_1 && image_crc != super.fsid.crc) {
+		die(FSCK_UNCORRECTED, 0, "crc error");
+	}
+	if (bad_files) {
+		die(FSCK_UNCORRECTED, 0, "%lu bad blocks in %lu files", bad_blocks, bad_files);
+	}
+}
+
 static void change_file_status(char *path, struct polyfs_inode *i)
 {
 	struct utimbuf epoch = { 0, 0 };
@@ -566,6 +955,11 @@ static void do_file(char *path, struct polyfs_inode *i)
 	if (opt_verbose) {
 		print_node('f', i, path);
 	}
+	if (opt_fast) {
+		if (i->size)
+			queue_job(path, i, (i->size + POLYFS_BLOCK_SIZE - 1) / POLYFS_BLOCK_SIZE);
+		return;
+	}
 	if (opt_extract) {
 		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, i->mode);
 		if (fd < 0) {
@@ -602,6 +996,14 @@ static void do_symlink(char *path, struct polyfs_inode *i)
 		end_data = next;
 	}
 
+	if (opt_fast) {
+		if (opt_verbose) {
+			print_node('l', i, path);
+		}
+		queue_job(path, i, 1);
+		return;
+	}
+
 	size = uncompress_block(romfs_read(curr), next - curr);
 	if (size != i->size) {
 		die(FSCK_UNCORRECTED, 0, "size error in symlink: %s", path);
@@ -708,6 +1110,9 @@ static void test_fs(int start)
 	inflateInit(&stream);
 	expand_fs(extract_dir, root);
 	inflateEnd(&stream);
+	if (opt_fast) {
+		run_jobs();
+	}
 	if (start_data != ~0UL) {
 		if (start_data < (sizeof(struct polyfs_super) + start)) {
 			die(FSCK_UNCORRECTED, 0, "directory data start (%ld) < sizeof(struct polyfs_super) + start (%ld)", start_data, sizeof(struct polyfs_super) + start);
@@ -735,7 +1140,7 @@ int main(int argc, char **argv)
 		progname = argv[0];
 
 	/* command line options */
-	while ((c = getopt(argc, argv, "hx:v")) != EOF) {
+	while ((c = getopt(argc, argv, "fhj:r:x:v")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(FSCK_OK);
@@ -750,15 +1155,38 @@ int main(int argc, char **argv)
 			case 'v':
 				opt_verbose++;
 				break;
+#ifdef INCLUDE_FS_TESTS
+			case 'f':
+				opt_fast = 1;
+				break;
+			case 'j':
+				opt_threads = atoi(optarg);
+				break;
+			case 'r':
+				opt_report = optarg;
+				break;
+#endif /* INCLUDE_FS_TESTS */
 		}
 	}
 
+#ifdef INCLUDE_FS_TESTS
+	if (opt_fast && opt_extract)
+		die(FSCK_USAGE, 0, "cannot extract in fast mode");
+	if (opt_report && !opt_fast)
+		die(FSCK_USAGE, 0, "a report requires fast mode (-f)");
+#endif /* INCLUDE_FS_TESTS */
+
 	if ((argc - optind) != 1)
 		usage(FSCK_USAGE);
 	filename = argv[optind];
 
 	test_super(&start, &length);
-	test_crc(start);
+#ifdef INCLUDE_FS_TESTS
+	if (opt_fast)
+		test_crc_fast(start, length);
+	else
+#endif /* INCLUDE_FS_TESTS */
+		test_crc(start);
 #ifdef INCLUDE_FS_TESTS
 	test_fs(start);
 #endif /* INCLUDE_FS_TESTS */